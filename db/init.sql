@@ -19,4 +19,30 @@ create table pessoas(
 -- loads postgres trigram
 create extension pg_trgm;
 -- creates index for search using trigram gist
-create index concurrently if not exists idx_pessoas_search on pessoas using gist (search gist_trgm_ops(siglen=64));
\ No newline at end of file
+create index concurrently if not exists idx_pessoas_search on pessoas using gist (search gist_trgm_ops(siglen=64));
+
+
+-- row count kept by triggers, reading it is O(1) where count(*) scans the table. Statement triggers with transition tables update it once per insert, batch or copy
+create table pessoas_contagem(
+	id int primary key,
+	total bigint not null
+);
+
+insert into pessoas_contagem (id, total) values (1, 0);
+
+create or replace function pessoas_contagem_insert() returns trigger as $$
+begin
+	update pessoas_contagem set total = total + (select count(*) from novas) where id = 1;
+	return null;
+end; $$ 
+language plpgsql;
+
+create or replace function pessoas_contagem_delete() returns trigger as $$
+begin
+	update pessoas_contagem set total = total - (select count(*) from removidas) where id = 1;
+	return null;
+end; $$ 
+language plpgsql;
+
+create trigger pessoas_contagem_insert after insert on pessoas referencing new table as novas for each statement execute function pessoas_contagem_insert();
+create trigger pessoas_contagem_delete after delete on pessoas referencing old table as removidas for each statement execute function pessoas_contagem_delete();
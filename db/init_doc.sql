@@ -0,0 +1,8 @@
+-- opt-in with SERVER_JSON_DOC=1, run after init.sql. Every insert pays for the stored column, so only databases of servers reading it should have it
+-- ready to send json document. Reads select only this column and send the bytes as they come
+-- immutable wrapper, json_build_object is only stable so it can not be used on a generated column directly
+create or replace function immutable_pessoas_doc(uuid, varchar, varchar, varchar, varchar[]) 
+    returns json as $$ select json_build_object('id', $1, 'apelido', $2, 'nome', $3, 'nascimento', $4, 'stack', $5); $$ 
+language sql immutable;
+
+alter table pessoas add column if not exists doc json generated always as ( immutable_pessoas_doc(id, apelido, nome, nascimento, stack) ) stored;
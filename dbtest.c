@@ -56,7 +56,7 @@ int main(int argq, char **argv, char **envp){
 
 	res = pessoas_insert(db, 1, "nico", "nico", "20000201", 3, stack);
 	if(res->code){
-		printf("Insert failed. Postgress: %s\n", res->msg);
+		printf("Insert failed. Postgress: %s\n", db_results_message(res));
 	}else{
 		printf("Insert ok!\n");
 	}
@@ -64,7 +64,7 @@ int main(int argq, char **argv, char **envp){
 
 	res = pessoas_insert(db, 1, "peterson", "jjpsss peterson joa", "19990206", 3, stack);
 	if(res->code){
-		printf("Insert failed. Postgress: %s\n", res->msg);
+		printf("Insert failed. Postgress: %s\n", db_results_message(res));
 	}else{
 		printf("Insert ok!\n");
 	}
@@ -72,7 +72,7 @@ int main(int argq, char **argv, char **envp){
 
 	res = pessoas_select_search(db, 1, "c#", 50);
 	if(res->code){
-		printf("Search failed. Postgress: %s\n", res->msg);
+		printf("Search failed. Postgress: %s\n", db_results_message(res));
 	}else{
 		printf("Search ok!\n");
 		db_print_results(res);
@@ -81,7 +81,7 @@ int main(int argq, char **argv, char **envp){
 
 	res = pessoas_select_uuid(db, 1, "4dcc0115-f0e7-486f-92a7-2c18109f1956");
 	if(res->code){
-		printf("Select uuid failed. Postgress: %s\n", res->msg);
+		printf("Select uuid failed. Postgress: %s\n", db_results_message(res));
 	}else{
 		printf("Select uuid ok!\n");
 		db_print_results(res);
@@ -90,7 +90,7 @@ int main(int argq, char **argv, char **envp){
 
 	res = pessoas_count(db, 1);
 	if(res->code){
-		printf("Count failed. Postgress: %s\n", res->msg);
+		printf("Count failed. Postgress: %s\n", db_results_message(res));
 	}else{
 		printf("Count ok!\n");
 		db_print_results(res);
@@ -2,14 +2,36 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 #include "src/string+.h"
 #include "facil.io/http.h"
 #include "src/varenv.h"
 #include "src/utils.h"
 #include "src/db.h"
 #include "models/pessoas.h"
+#include "models/pessoas_batch.h"
+#include "models/pessoas_store.h"
+#include "models/pessoas_search.h"
+#include "models/pessoas_search_cache.h"
+#include "models/pessoas_count.h"
+#include "models/pessoas_load.h"
+#include "models/pessoas_body.h"
+#include "models/shared.h"
 #include "models/date.h"
 
+#define EXPORT_CHUNK 16384															// bytes of rows gathered before a chunk is written
+#define EXPORT_MAX_PENDING 8														// packets queued on the socket before the export waits for the client
+#define EXPORT_DB_CONNS 2															// connections of the export pool of each worker, more exports at once wait for one
+#define SEARCH_CACHE_DEFAULT 4096													// cached search terms of each worker when SERVER_SEARCH_CACHE is not set
+#define SEARCH_CACHE_STALE_DEFAULT 1000												// ms a cached search may be served at most when SERVER_SEARCH_CACHE_STALE_MS is not set
+#define STORE_DEFAULT_MB 64															// shared memory of the GET /pessoas/:id store when SERVER_STORE_MB is not set
+
+// startup
+db_t *db_open(int conns_min, int conns, int conns_ready);
+int load_main(char *path);
+void on_worker_start(void *udata);
+void on_worker_finish(void *udata);
+
 // handlers
 void on_request(http_s *h);
 void on_get(http_s *h);
@@ -18,12 +40,64 @@ void on_get(http_s *h);
 void on_get_count(http_s *h);
 void on_get_uuid(http_s *h);
 void on_get_search(http_s *h);
+void on_get_export(http_s *h);
+void on_get_metrics(http_s *h);
+char *path_uuid(http_s *h);
 
 // post
 void on_post(http_s *h);
-
-// global db
-db_t *db;
+void post_on_written(pessoas_row_t *row, pessoas_batch_result_t result, void *udata);
+
+// http request paused while waiting on a db query. Resumed once both the pause task and the query callback ran
+typedef struct{
+	http_pause_handle_s *handle;
+	db_results_t *results;
+	void (*respond)(http_s *h, db_results_t *res);
+	string *body;																	// response made by someone else, sent with status instead of calling respond
+	int status;
+	volatile uint8_t ready;
+}pending_request_t;
+
+// pause the request until the query started with pending_request_on_results as callback returns
+void pending_request_pause(http_s *h, pending_request_t *pending);
+void pending_request_on_results(db_results_t *results, void *udata);
+
+// export streamed as a chunked response, straight to the hijacked socket
+typedef struct{
+	intptr_t uuid;
+	string *chunk;
+	size_t rows;
+	bool headers_sent;
+}export_stream_t;
+
+bool export_on_row(db_results_t *row, void *udata);
+void *export_run(void *udata);
+
+// responses
+void respond_search(http_s *h, db_results_t *res);
+void search_select(char *term, db_callback_t callback, void *udata);
+void search_flight_on_results(db_results_t *results, void *udata);
+void respond_uuid(http_s *h, db_results_t *res);
+void respond_doc(http_s *h, db_results_t *res);
+int search_json(db_results_t *res, string *json);
+void respond_created(http_s *h, char *id);
+
+// db of this worker, opened once it started
+db_t *db = NULL;
+
+// export pool of this worker. Exports stream for as long as the client reads, they never hold a connection of the requests
+db_t *export_db = NULL;
+
+// export threads still streaming, the export pool stays open until they are done
+volatile size_t export_running = 0;
+
+// pool bounds of every worker
+int db_conns;
+int db_conns_min;
+int db_conns_ready;
+
+// reads send the precomputed doc column, see db/init_doc.sql. Its statements are only prepared then
+bool json_doc = false;
 
 // main
 int main(int argq, char **argv, char **envp){
@@ -34,15 +108,101 @@ int main(int argq, char **argv, char **envp){
 	loadEnvVars(NULL);
 
 	char *port = getenv("SERVER_PORT");
+	char *socket_path = getenv("SERVER_SOCKET");
 	char *workers_env = getenv("SERVER_WORKERS");
 	char *threads_env = getenv("SERVER_THREADS");
 	char *conns_env = getenv("SERVER_DB_CONNS");
+	char *conns_min_env = getenv("SERVER_DB_CONNS_MIN");
+	char *conns_ready_env = getenv("SERVER_DB_CONNS_READY");
+	char *json_doc_env = getenv("SERVER_JSON_DOC");
+	char *store_env = getenv("SERVER_STORE_MB");
+	char *search_local_env = getenv("SERVER_SEARCH_LOCAL");
+	char *search_cache_env = getenv("SERVER_SEARCH_CACHE");
+	char *search_cache_stale_env = getenv("SERVER_SEARCH_CACHE_STALE_MS");
 	int threads = atoi(threads_env);
 	int conns = atoi(conns_env);
+	int conns_min = conns_min_env != NULL ? atoi(conns_min_env) : conns;
+	int conns_ready = conns_ready_env != NULL ? atoi(conns_ready_env) : 1;
 	int workers = atoi(workers_env);
+	int store_mb = store_env != NULL ? atoi(store_env) : STORE_DEFAULT_MB;
+	int search_cache = search_cache_env != NULL ? atoi(search_cache_env) : SEARCH_CACHE_DEFAULT;
+	int search_cache_stale = search_cache_stale_env != NULL ? atoi(search_cache_stale_env) : SEARCH_CACHE_STALE_DEFAULT;
+	json_doc = json_doc_env != NULL && atoi(json_doc_env) != 0;
+	bool search_local = search_local_env != NULL && atoi(search_local_env) != 0;
+
+	// ./webserver --load file.jsonl writes the pessoas of the file to the db and exits without serving
+	if(argq == 3 && strcmp(argv[1], "--load") == 0)
+		return load_main(argv[2]);
+
+	// one connection to fill what the workers share, closed before they fork. Each worker opens its own pool on start
+	db_conns = conns;
+	db_conns_min = conns_min;
+	db_conns_ready = conns_ready;
+
+	db_t *setup = db_open(1, 1, 1);
+	if(setup == NULL)
+		exit(1);
+
+	// memory shared by the workers, made before they fork: apelidos, count and the GET /pessoas/:id store
+	size_t store_budget = (size_t)store_mb << 20;
+	if(
+		!shared_init(pessoas_apelidos_shared_size() + store_budget + (1 << 20)) ||		// a spare MB for headers and alignment, untouched pages cost nothing
+		!pessoas_apelidos_init() ||
+		!pessoas_store_init(store_budget)
+	){
+		db_destroy(setup);
+		exit(2);
+	}
+
+	// known apelidos, duplicates are answered without the db, and the count seed
+	if(!pessoas_apelidos_load(setup) || !pessoas_count_init(setup)){
+		db_destroy(setup);
+		exit(1);
+	}
+
+	// searches answered by the trigram index of this process
+	if(search_local){
+		pessoas_search_init();
+		if(!pessoas_search_load(setup)){
+			db_destroy(setup);
+			exit(1);
+		}
+	}
+
+	db_destroy(setup);
+
+	pessoas_search_cache_init(search_cache, search_cache_stale);
+
+	// webserver setup, a unix socket path takes the place of the port
+	bool unix_socket = socket_path != NULL && socket_path[0] != '\0';
+	intptr_t listener = unix_socket ?
+		http_listen(NULL, socket_path, .on_request = on_request, .log = false) :
+		http_listen(port, NULL, .on_request = on_request, .log = false);
 
-	// db connection
-	db = db_create(db_vendor_postgres, conns,
+	if(listener == -1){
+		printf("Could not listen on [%s]\n", unix_socket ? socket_path : port);
+		exit(2);
+	}
+
+	// pool, flush and reconcile timers of every worker, or of this process when it is the only one
+	fio_state_callback_add(FIO_CALL_ON_START, on_worker_start, NULL);
+	fio_state_callback_add(FIO_CALL_ON_FINISH, on_worker_finish, NULL);
+
+	printf("Starting webserver with [%d] threads\n", threads);
+	if(unix_socket)
+		printf("Webserver listening on unix socket: [%s]\n", socket_path);
+	else
+		printf("Webserver listening on port: [%s]\n", port);
+	fio_start(.threads = threads, .workers = workers);
+
+	printf("Stopping server...\n");
+
+	return 0;
+}
+
+// new db with the pessoas statements, connected once ready connections are up. NULL on failure
+db_t *db_open(int conns_min, int conns, int conns_ready){
+	db_t *opened = db_create(db_vendor_postgres, conns,
 		getenv("DB_HOST"),
 		getenv("DB_PORT"),
 		getenv("DB_DATABASE"),
@@ -52,47 +212,83 @@ int main(int argq, char **argv, char **envp){
 		NULL
 	);
 
-	if(db == NULL){
+	if(opened == NULL){
 		printf("Could not create database object. Host, database or user were passed as NULL\n");
-		exit(2);
+		return NULL;
 	}
 
-	printf("Creating postgres connections [%d]\n", conns);
-	db_connect(db);
+	db_set_format(opened, db_format_binary);
+	db_set_results_mode(opened, db_results_borrowed);
+	db_set_pool_size(opened, conns_min, conns);
 
-	bool wait = true;
-	while(wait){
-		switch(db_stat(db)){
-			default:
-				break;
+	if(!pessoas_prepare(opened) || !pessoas_batch_prepare(opened) || (json_doc && !pessoas_prepare_doc(opened)) || (pessoas_search.enabled && !pessoas_search_prepare(opened))){
+		printf("Could not register pessoas prepared statements\n");
+		db_destroy(opened);
+		return NULL;
+	}
 
-			case db_state_invalid_db:
-			case db_state_failed_connection:
-				printf("Failed to create connections to postgres db\n");
-				db_destroy(db);
-				exit(1);
-				break;
-			
-			case db_state_connected:
-				wait = false;
-				break;
-		}
+	printf("Creating postgres connections [%d] of max [%d]\n", conns_min, conns);
+	db_connect(opened);
+
+	// serve as soon as a few are up, the others come up in the background
+	if(db_wait(opened, conns_ready, DB_CONNECT_TIMEOUT) != db_state_connected){
+		printf("Failed to create connections to postgres db\n");
+		db_destroy(opened);
+		return NULL;
 	}
 
 	printf("Postgres connections up!\n");
+	return opened;
+}
 
-	// webserver setup
-	http_listen(port, NULL, .on_request = on_request, .log = false);
+// --load mode. The apelidos of the db are loaded first so the file can not repeat them
+int load_main(char *path){
+	db_t *loader = db_open(1, 1, 1);
+	if(loader == NULL)
+		return 1;
 
-	printf("Starting webserver with [%d] threads\n", threads);
-	printf("Webserver listening on port: [%s]\n", port);
-	fio_start(.threads = threads, .workers = workers);
+	if(!shared_init(pessoas_apelidos_shared_size()) || !pessoas_apelidos_init() || !pessoas_apelidos_load(loader)){
+		db_destroy(loader);
+		return 2;
+	}
 
-	printf("Stopping server...\n");
+	bool ok = pessoas_load(loader, path);
+
+	db_destroy(loader);
+	return ok ? 0 : 1;
+}
+
+// worker start, after the fork. Connections and timers made before it would be shared by every worker
+void on_worker_start(void *udata){
+	db = db_open(db_conns_min, db_conns, db_conns_ready);
+	export_db = db_open(1, EXPORT_DB_CONNS, 1);
+	if(db == NULL || export_db == NULL)
+		exit(1);
+
+	pessoas_batch_start();
+	pessoas_count_start(db);
+	pessoas_search_start(db);
 
+	(void)udata;
+}
+
+// worker stop, the reactor is down. Rows still queued are written before the process exits
+void on_worker_finish(void *udata){
+	if(db == NULL)																	// root of many workers, it never opened a pool
+		return;
+
+	pessoas_batch_stop();
 	db_destroy(db);
+	db = NULL;
 
-	return 0;
+	struct timespec wait = {0, 1000000};
+	while(__atomic_load_n(&export_running, __ATOMIC_ACQUIRE) > 0)					// their sockets were closed with the reactor, they stop at the next row
+		nanosleep(&wait, NULL);
+
+	db_destroy(export_db);
+	export_db = NULL;
+
+	(void)udata;
 }
 
 // main callback
@@ -116,6 +312,12 @@ void on_get(http_s *h){
 	if(fiobj_str_cmp(h->path, "/contagem-pessoas")){								// count
 		on_get_count(h);
 	}
+	else if(fiobj_str_cmp(h->path, "/exportar-pessoas")){							// export every pessoa
+		on_get_export(h);
+	}
+	else if(fiobj_str_cmp(h->path, "/metrics")){									// db metrics of this worker
+		on_get_metrics(h);
+	}
 	else if(fiobj_str_substr(h->path, "/pessoas")){									// get 
 
 		if(h->query != FIOBJ_INVALID){												// search 
@@ -131,22 +333,85 @@ void on_get(http_s *h){
 	}
 }
 
-// count
+// new pending request
+pending_request_t *pending_request_new(void (*respond)(http_s *h, db_results_t *res)){
+	pending_request_t *pending = calloc(1, sizeof(pending_request_t));
+	pending->respond = respond;
+	return pending;
+}
+
+// resumed on the http connection with the query results
+void pending_request_on_resume(http_s *h){
+	pending_request_t *pending = h->udata;
+	h->udata = NULL;
+
+	if(pending->body == NULL)
+		pending->respond(h, pending->results);
+	else if(pending->status == http_status_code_Created)							// body is the id of the new pessoa
+		respond_created(h, pending->body->raw);
+	else if(pending->status != http_status_code_Ok)
+		http_send_error(h, pending->status);
+	else
+		http_send_body(h, pending->body->raw, pending->body->len);
+
+	db_results_destroy(pending->results);
+	string_destroy(pending->body);
+	free(pending);
+}
+
+// connection was lost while paused
+void pending_request_on_fallback(void *udata){
+	pending_request_t *pending = udata;
+	db_results_destroy(pending->results);
+	string_destroy(pending->body);
+	free(pending);
+}
+
+// the second one to arrive, pause task or query results, resumes the request
+void pending_request_ready(pending_request_t *pending){
+	if(fio_atomic_add(&pending->ready, 1) == 2)
+		http_resume(pending->handle, pending_request_on_resume, pending_request_on_fallback);
+}
+
+// pause task
+void pending_request_on_pause(http_pause_handle_s *handle){
+	pending_request_t *pending = http_paused_udata_get(handle);
+	pending->handle = handle;
+	pending_request_ready(pending);
+}
+
+// query callback
+void pending_request_on_results(db_results_t *results, void *udata){
+	pending_request_t *pending = udata;
+	pending->results = results;
+	pending_request_ready(pending);
+}
+
+// pause the request
+void pending_request_pause(http_s *h, pending_request_t *pending){
+	h->udata = pending;
+	http_pause(h, pending_request_on_pause);
+}
+
+// count, kept in process and shared by the workers
 void on_get_count(http_s *h){
-	db_results_t *res = pessoas_count(db); 
-	if(res->code){
-		printf("On GET count failed. DB query failed. Database: %s\n", res->msg);
-		http_send_error(h, http_status_code_InternalServerError);
-	}
-	else{
-		int *count = db_results_read_integer(res, 0, 0);
-		string *response = string_sprint("%d", 15, count != NULL ? *count : -1);
-		http_send_body(h, response->raw, response->len);
+	char response[24];
+	int len = snprintf(response, sizeof(response), "%lu", pessoas_count_get());
+	http_send_body(h, response, len);
+}
 
-		string_destroy(response);
-	}
+// metrics, prometheus text format
+void on_get_metrics(http_s *h){
+	size_t len;
+	char *text = db_metrics_text(db, &len);
 
-	db_results_destroy(res);
+	FIOBJ name = fiobj_str_new("Content-Type", 12);
+	FIOBJ value = fiobj_str_new("text/plain; version=0.0.4", 25);
+	http_set_header(h, name, value);
+	fiobj_free(name);
+
+	http_send_body(h, text, len);
+	free(text);
 }
 
 // search
@@ -160,46 +425,131 @@ void on_get_search(http_s *h){
 	if(value == FIOBJ_INVALID){
 		h->status = http_status_code_BadRequest;								// search without "t" value
 		http_send_body(h, "Bad request", 11);
+		return;
 	}
 
 	char *tquery = fiobj_obj2cstr(value).data;	
 
-	// db call
-	db_results_t *res = pessoas_select_search(db, tquery, 50);
-
-	if(res->entries_count == 0){
-		http_send_body(h, "[]", 2);
-		db_results_destroy(res);
+	if(pessoas_search.enabled){														// local index, no db
+		size_t len;
+		char *json = pessoas_search_find(tquery, PESSOAS_SEARCH_LIMIT, &len);
+		http_send_body(h, json, len);
 		return;
 	}
-	
-	switch(res->code){
-		case db_error_code_ok:
-		{
-			char *json = db_json_entries(res, false);
-			http_send_body(h, json, strlen(json));
-			free(json);
-		}
-		break;			
 
-		default:
-			printf("On GET search failed. DB query failed. Database: %s\n", res->msg);
-			http_send_error(h, http_status_code_InternalServerError);
+	// cached, or already being queried by another request
+	pending_request_t *pending = pending_request_new(respond_search);
+	string *cached = string_new_sized(4096);
+
+	switch(pessoas_search_cache_lookup(tquery, cached, pending)){
+		case pessoas_search_cache_hit:
+			http_send_body(h, cached->raw, cached->len);
+			string_destroy(cached);
+			free(pending);
+			return;
+
+		case pessoas_search_cache_wait:
+			string_destroy(cached);
+			pending_request_pause(h, pending);
+			return;
+
+		case pessoas_search_cache_lead:
+			string_destroy(cached);
+			search_select(tquery, search_flight_on_results, strdup(tquery));
+			pending_request_pause(h, pending);
+			return;
+
+		case pessoas_search_cache_bypass:
+			string_destroy(cached);
+			search_select(tquery, pending_request_on_results, pending);
+			pending_request_pause(h, pending);
+			return;
 	}
-	
-	db_results_destroy(res);
 }
 
-// get uuid
-void on_get_uuid(http_s *h){
-	if(!fiobj_str_substr(h->path, "/pessoas")){										// not /pessoas/* path
-		h->status = http_status_code_BadRequest;
-		http_send_body(h, "Not found", 9);
-		return;
+// search query with the statement of the configured mode
+void search_select(char *term, db_callback_t callback, void *udata){
+	if(json_doc)
+		pessoas_select_search_doc(db, term, 50, callback, udata);
+	else
+		pessoas_select_search(db, term, 50, callback, udata);
+}
+
+// search query of a cached term done. Every request waiting on the term is answered with a copy of the response
+void search_flight_on_results(db_results_t *results, void *udata){
+	char *term = udata;
+	string *json = string_new_sized(4096);
+	int status = search_json(results, json);
+
+	if(status != http_status_code_Ok)
+		printf("On GET search failed. DB query failed. Database: %s\n", db_results_message(results));
+
+	size_t count;
+	bool cacheable = status == http_status_code_Ok && results->code == db_error_code_ok;
+	void **waiters = pessoas_search_cache_complete(term, cacheable ? json->raw : NULL, json->len, &count);
+
+	for(size_t i = 0; i < count; i++){
+		pending_request_t *pending = waiters[i];
+		pending->status = status;
+		pending->body = string_new_sized(json->len + 1);
+		string_cat_bytes(pending->body, json->raw, json->len);
+		pending_request_ready(pending);
+	}
+
+	free(waiters);
+	free(term);
+	string_destroy(json);
+	db_results_destroy(results);
+}
+
+// search response body for the results of either search statement. Returns the http status, json is written on 200
+int search_json(db_results_t *res, string *json){
+	if(res->code == db_error_code_timeout)											// cancelled by the search timeout, not an empty result
+		return http_status_code_GatewayTimeout;
+
+	if(res->code != db_error_code_ok)
+		return http_status_code_InternalServerError;
+
+	if(res->entries_count == 0){													// nothing found
+		string_cat_bytes(json, "[]", 2);
+		return http_status_code_Ok;
 	}
 
+	if(json_doc){																	// one row, the json array built by the db
+		char *doc = db_results_read_string(res, 0, 0);
+		if(doc == NULL)
+			return http_status_code_InternalServerError;
+
+		string_cat_bytes(json, doc, strlen(doc));
+		return http_status_code_Ok;
+	}
+
+	size_t len;
+	char *entries = db_json_entries_buffered(res, false, &len);
+	string_cat_bytes(json, entries, len);
+	return http_status_code_Ok;
+}
+
+// search response
+void respond_search(http_s *h, db_results_t *res){
+	string *json = string_new_sized(4096);
+	int status = search_json(res, json);
+
+	if(status == http_status_code_Ok){
+		http_send_body(h, json->raw, json->len);
+	}
+	else{
+		printf("On GET search failed. DB query failed. Database: %s\n", db_results_message(res));
+		http_send_error(h, status);
+	}
+
+	string_destroy(json);
+}
+
+// uuid after the last slash of the path, NULL if there is none
+char *path_uuid(http_s *h){
 	char *pathstr = fiobj_obj2cstr(h->path).data;
-	char *cursor = pathstr + strlen(pathstr);										// get uuid
+	char *cursor = pathstr + strlen(pathstr);
 	while(cursor > pathstr){
 		if(*cursor == '/')
 			break;
@@ -207,43 +557,221 @@ void on_get_uuid(http_s *h){
 		cursor--;
 	}
 
-	if(cursor == pathstr){															// no uuid
+	return cursor != pathstr ? cursor + 1 : NULL;
+}
+
+// get uuid
+void on_get_uuid(http_s *h){
+	if(!fiobj_str_substr(h->path, "/pessoas")){										// not /pessoas/* path
+		h->status = http_status_code_BadRequest;
+		http_send_body(h, "Not found", 9);
+		return;
+	}
+
+	char *uuid = path_uuid(h);
+	if(uuid == NULL){																// no uuid
 		h->status = http_status_code_BadRequest;
 		http_send_body(h, "Not found", 9);
 		return;
 	}
 
-	char *uuid = cursor + 1;
+	size_t len;
+	char *json = pessoas_store_get(uuid, &len);										// created or read recently by this worker
+	if(json != NULL){
+		http_send_body(h, json, len);
+		return;
+	}
 
 	// db call
-	db_results_t *res = pessoas_select_uuid(db, uuid);
+	if(json_doc){
+		pending_request_t *pending = pending_request_new(respond_doc);
+		pessoas_select_uuid_doc(db, uuid, pending_request_on_results, pending);
+		pending_request_pause(h, pending);
+		return;
+	}
 
+	pending_request_t *pending = pending_request_new(respond_uuid);
+	pessoas_select_uuid(db, uuid, pending_request_on_results, pending);
+	pending_request_pause(h, pending);
+}
+
+// get uuid response
+void respond_uuid(http_s *h, db_results_t *res){
 	if(res->entries_count == 0){
 		http_send_error(h, http_status_code_BadRequest);
-		db_results_destroy(res);
 		return;
 	}
 	
 	switch(res->code){
 		case db_error_code_invalid_type:
+		{
+			char *msg = (char*)db_results_message(res);
 			h->status = http_status_code_UnprocessableEntity;
-			http_send_body(h, res->msg, strlen(res->msg));
+			http_send_body(h, msg, strlen(msg));
+		}
+		break;
+
+		case db_error_code_ok:
+		{
+			size_t len;
+			char *json = db_json_entries_buffered(res, true, &len);
+			http_send_body(h, json, len);
+			pessoas_store_put(path_uuid(h), json, len);								// read through, the next GET skips the db
+		}
+		break;
+
+		default:
+			http_send_error(h, http_status_code_InternalServerError);
 			break;
+	}
+}
 
+// get uuid doc response. The single field already is the json to send
+void respond_doc(http_s *h, db_results_t *res){
+	switch(res->code){
 		case db_error_code_ok:
 		{
-			char *json = db_json_entries(res, true);
-			http_send_body(h, json, strlen(json));
-			free(json);
+			char *doc = res->entries_count != 0 ? db_results_read_string(res, 0, 0) : NULL;
+			if(doc == NULL){
+				http_send_error(h, http_status_code_BadRequest);							// no pessoa with this uuid
+				break;
+			}
+
+			http_send_body(h, doc, strlen(doc));
+			pessoas_store_put(path_uuid(h), doc, strlen(doc));						// read through, the next GET skips the db
+		}
+		break;
+
+		case db_error_code_invalid_type:
+		{
+			char *msg = (char*)db_results_message(res);
+			h->status = http_status_code_UnprocessableEntity;
+			http_send_body(h, msg, strlen(msg));
 		}
 		break;
 
 		default:
+			printf("On GET doc failed. DB query failed. Database: %s\n", db_results_message(res));
 			http_send_error(h, http_status_code_InternalServerError);
 			break;
 	}
-	
+}
+
+// write gathered rows as one chunk, then wait while the client is behind so memory stays flat. Only the export thread waits, the reactor keeps writing
+void export_flush(export_stream_t *stream){
+	if(!stream->headers_sent){
+		char *headers = 
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/json\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"Connection: close\r\n"
+			"\r\n";
+
+		fio_write(stream->uuid, headers, strlen(headers));
+		stream->headers_sent = true;
+	}
+
+	if(stream->chunk->len == 0)
+		return;
+
+	char size[20];
+	int len = snprintf(size, sizeof(size), "%lx\r\n", stream->chunk->len);
+	fio_write(stream->uuid, size, len);
+	fio_write(stream->uuid, stream->chunk->raw, stream->chunk->len);
+	fio_write(stream->uuid, "\r\n", 2);
+	stream->chunk->len = 0;
+
+	struct timespec wait = {0, 1000000};
+	while(fio_is_valid(stream->uuid) && fio_pending(stream->uuid) > EXPORT_MAX_PENDING){
+		fio_flush(stream->uuid);
+		nanosleep(&wait, NULL);
+	}
+}
+
+// export row callback, false stops the query once the client is gone
+bool export_on_row(db_results_t *row, void *udata){
+	export_stream_t *stream = udata;
+	if(!fio_is_valid(stream->uuid))
+		return false;
+
+	string_cat_bytes(stream->chunk, stream->rows == 0 ? "[" : ",", 1);
+
+	size_t len;
+	char *json = db_json_entries_buffered(row, true, &len);
+	string_cat_bytes(stream->chunk, json, len);
+	stream->rows++;
+
+	if(stream->chunk->len >= EXPORT_CHUNK)
+		export_flush(stream);
+
+	return true;
+}
+
+// export. The socket is handed to a thread of its own that streams rows as they come from the db, so a slow client never blocks a worker thread
+void on_get_export(http_s *h){
+	export_stream_t *stream = malloc(sizeof(export_stream_t));
+	stream->uuid = http_hijack(h, NULL);
+	stream->chunk = string_new_sized(EXPORT_CHUNK + 1024);
+	stream->rows = 0;
+	stream->headers_sent = false;
+
+	fio_atomic_add(&export_running, 1);
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, export_run, stream) != 0){
+		fio_atomic_sub(&export_running, 1);
+		printf("On GET export failed. Could not start the export thread\n");
+
+		char *error = 
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n"
+			"\r\n";
+
+		fio_write(stream->uuid, error, strlen(error));
+		fio_close(stream->uuid);
+
+		string_destroy(stream->chunk);
+		free(stream);
+		return;
+	}
+
+	pthread_detach(thread);
+}
+
+// export thread. Streams every pessoa on the export pool, then closes the socket
+void *export_run(void *udata){
+	export_stream_t *stream = udata;
+	db_results_t *res = pessoas_export(export_db, export_on_row, stream);
+
+	if(res->code == db_error_code_ok){
+		string_cat_bytes(stream->chunk, stream->rows == 0 ? "[]" : "]", stream->rows == 0 ? 2 : 1);
+		export_flush(stream);
+		fio_write(stream->uuid, "0\r\n\r\n", 5);									// last chunk
+	}
+	else if(!stream->headers_sent){
+		printf("On GET export failed. DB query failed. Database: %s\n", db_results_message(res));
+
+		char *error = 
+			"HTTP/1.1 500 Internal Server Error\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n"
+			"\r\n";
+
+		fio_write(stream->uuid, error, strlen(error));
+	}
+	else{																			// already streaming, closing without the last chunk tells the client it is truncated
+		printf("On GET export failed after [%lu] rows. Database: %s\n", stream->rows, db_results_message(res));
+	}
+
+	fio_close(stream->uuid);
+
 	db_results_destroy(res);
+	string_destroy(stream->chunk);
+	free(stream);
+
+	fio_atomic_sub(&export_running, 1);
+	return NULL;
 }
 
 // post
@@ -254,144 +782,97 @@ void on_post(http_s *h){
 		return;
 	}
 
-	// get values
-	FIOBJ key = fiobj_str_new("", 1);
+	pessoas_body_t body;
+	switch(pessoas_body_parse(h->params, &body)){
+		case pessoas_body_ok:
+			break;
 
-	// apelido
-	fiobj_str_clear(key);
-	fiobj_str_write(key, "apelido", 7);
-	char *apelido   	= fiobj_obj2cstr(fiobj_hash_get(h->params, key)).data;
-	if(strlen(apelido) > 32){
-		h->status = http_status_code_UnprocessableEntity;
-		http_send_body(h, "Apelido maior que 32 caracteres", 31);
-		fiobj_free(key);
-		return;
-	}
+		case pessoas_body_invalid_apelido:
+			h->status = http_status_code_UnprocessableEntity;
+			http_send_body(h, "Apelido maior que 32 caracteres", 31);
+			return;
 
-	// nome
-	fiobj_str_clear(key);
-	fiobj_str_write(key, "nome", 4);
-	char *nome      	= fiobj_obj2cstr(fiobj_hash_get(h->params, key)).data;
-	if(strlen(nome) > 100){
-		h->status = http_status_code_UnprocessableEntity;
-		http_send_body(h, "Nome maior que 100 caracteres", 29);
-		fiobj_free(key);
-		return;
-	}
+		case pessoas_body_invalid_nome:
+			h->status = http_status_code_UnprocessableEntity;
+			http_send_body(h, "Nome maior que 100 caracteres", 29);
+			return;
 
-	// nascimento
-	fiobj_str_clear(key);
-	fiobj_str_write(key, "nascimento", 10);
-	char *nascimento	= fiobj_obj2cstr(fiobj_hash_get(h->params, key)).data;
-	if(
-		(strlen(nascimento) != 10) ||
-		(!date_check(nascimento))
-	){
-		h->status = http_status_code_UnprocessableEntity;
-		http_send_body(h, "Idade de nascimento inválida (YYYY-MM-DD)", 42);
-		fiobj_free(key);
-		return;
+		case pessoas_body_invalid_nascimento:
+			h->status = http_status_code_UnprocessableEntity;
+			http_send_body(h, "Idade de nascimento inválida (YYYY-MM-DD)", 42);
+			return;
+
+		case pessoas_body_invalid_stack:
+			h->status = http_status_code_UnprocessableEntity;
+			http_send_body(h, "Uma das stacks é maior que 32 caracteres", 41);
+			return;
 	}
 
-	// stack
-	fiobj_str_clear(key);
-	fiobj_str_write(key, "stack", 5);
+	char *stack[body.stack_count + 1];
+	pessoas_body_stack(&body, stack);
 
-	FIOBJ stackobj = fiobj_hash_get(h->params, key);
-	size_t stacksize;
+	pending_request_t *pending = pending_request_new(NULL);
+	bool queued = pessoas_batch_insert(body.nome, body.apelido, body.nascimento, body.stack_count, body.stack_count > 0 ? stack : NULL, post_on_written, pending);
 
-	fiobj_free(key);
+	if(!queued){																	// apelido already taken
+		free(pending);
+		h->status = http_status_code_UnprocessableEntity;
+		http_send_body(h, "Apelido já cadastrado", 22);
+		return;
+	}
 
-	db_results_t *res;
+	// answered once the batch of the row was written, so a 201 is always in the db
+	pending_request_pause(h, pending);
+}
 
-	if(
-		(stackobj == FIOBJ_INVALID) ||
-		(FIOBJ_IS_NULL(stackobj)) ||
-		(!FIOBJ_TYPE_IS(stackobj, FIOBJ_T_ARRAY)) ||
-		(fiobj_ary_count(stackobj) == 0)
-	){																				// if no stack
-		stacksize = 0;
-		res = pessoas_insert(db, nome, apelido, nascimento, stacksize, NULL);
-	}
-	else{																			// with valid stack
-		stacksize = fiobj_ary_count(stackobj);
-		char *stack[stacksize];
-
-		// stack value
-		for(size_t i = 0; i < stacksize; i++){
-			stack[i] = fiobj_obj2cstr(fiobj_ary_index(stackobj, i)).data;
-
-			if(strlen(stack[i]) > 32){
-				h->status = http_status_code_UnprocessableEntity;
-				http_send_body(h, "Uma das stacks é maior que 32 caracteres", 41);
-				fiobj_free(key);
-				return;
-			}
-		}
+// row of a POST written or given up by the batch. Written ones are handed to the store, search and count before the answer, so a GET after the 201 finds them
+void post_on_written(pessoas_row_t *row, pessoas_batch_result_t result, void *udata){
+	pending_request_t *pending = udata;
 
-		res = pessoas_insert(db, nome, apelido, nascimento, stacksize, stack);
-	}
+	switch(result){
+		case pessoas_batch_written:
+			pessoas_store_put_fields(row->id, row->apelido, row->nome, row->nascimento, row->stack_count, row->stack);
+			pessoas_search_written(row->id, row->apelido, row->nome, row->nascimento, row->stack_count, row->stack);
+			pessoas_search_cache_bump();
+			pessoas_count_add(1);
 
-	// db call
-	switch(res->code){
-		case db_error_code_ok:
-		{
-			// header Location
-			FIOBJ name = fiobj_str_new("Location", 8);
-			FIOBJ value = fiobj_str_new(NULL, 0);
-			fiobj_str_printf(value, "/pessoas/%s", db_results_read_string(res, 0, 0));
-			http_set_header(h, name, value);
-
-			// json body id
-			FIOBJ json = fiobj_str_new(NULL, 0);
-			fiobj_str_printf(json, "{\"id\":\"%s\"}", db_results_read_string(res, 0, 0));
-			fio_str_info_s jsonstr = fiobj_obj2cstr(json);
-			
-			h->status = http_status_code_Created;
-			http_send_body(h, jsonstr.data, jsonstr.len);
-
-			fiobj_free(name);
-			fiobj_free(json);
-		}
-		break;
+			pending->status = http_status_code_Created;
+			pending->body = string_from(row->id);
+			break;
 
-		case db_error_code_invalid_range:
-		case db_error_code_invalid_type:
-		case db_error_code_unique_constrain_violation:
-			h->status = http_status_code_UnprocessableEntity;
+		case pessoas_batch_taken:													// the apelido was written first, by another instance or past a full apelidos shard
+			pending->status = http_status_code_UnprocessableEntity;
+			pending->body = string_new();
+			break;
 
-			// printf("[%s.%i] (%s) [DEBUG] UnprocessableEntity: \n"
-			// 	"nome:       %s\n"
-			// 	"apelido:    %s\n"
-			// 	"nascimento: %s\n"
-			// 	"stack size: %lu\n"
-			// 	"\n"
-			// 	"Database msg: '%s'\n"
-			// 	, __FILE__, __LINE__, __func__, 
-			// 	nome, apelido, nascimento, stacksize, res->msg
-			// );
-			
-			http_send_body(h, res->msg, strlen(res->msg));
+		case pessoas_batch_rejected:												// invalid data for the db, as a single insert was answered
+			pending->status = http_status_code_UnprocessableEntity;
+			pending->body = string_new();
 			break;
 
-		default:
-			h->status = http_status_code_InternalServerError;
-			
-			printf("[%s.%i] (%s) [DEBUG] InternalServerError: \n"
-				"nome:       %s\n"
-				"apelido:    %s\n"
-				"nascimento: %s\n"
-				"stack size: %lu\n"
-				"\n"
-				"Database msg: '%s'\n"
-				, __FILE__, __LINE__, __func__, 
-				nome, apelido, nascimento, stacksize, res->msg
-			);
-
-			http_send_body(h, res->msg, strlen(res->msg));
+		case pessoas_batch_failed:													// retries exhausted or the connection is gone
+			pending->status = http_status_code_ServiceUnavailable;
+			pending->body = string_new();
 			break;
 	}
 
-	db_results_destroy(res);
+	pending_request_ready(pending);
 }
 
+// post response, header Location and json body with the new id
+void respond_created(http_s *h, char *id){
+	FIOBJ name = fiobj_str_new("Location", 8);
+	FIOBJ value = fiobj_str_new(NULL, 0);
+	fiobj_str_printf(value, "/pessoas/%s", id);
+	http_set_header(h, name, value);
+
+	FIOBJ json = fiobj_str_new(NULL, 0);
+	fiobj_str_printf(json, "{\"id\":\"%s\"}", id);
+	fio_str_info_s jsonstr = fiobj_obj2cstr(json);
+	
+	h->status = http_status_code_Created;
+	http_send_body(h, jsonstr.data, jsonstr.len);
+
+	fiobj_free(name);
+	fiobj_free(json);
+}
@@ -2,57 +2,151 @@
 #define _PESSOAS_HEADER_
 
 #include "../src/db.h"
+#include "../src/string+.h"
 
-// insert model into db
-db_results_t *pessoas_insert(db_t *db, char *nome, char *apelido, char *nascimento, size_t stack_count, char **stack){
-	char *query = "insert into pessoas "
-	 	"(id, apelido, nome, nascimento, stack) "
-	 	"values("
-			"gen_random_uuid(),"
-			"$1,"
-			"$2,"
-			"$3,"
-			"$4"
-		") "
-		"returning id";
+#define PESSOAS_SEARCH_TIMEOUT 1000													// ms a search may run before it is cancelled, a slow term must not hold a connection
 
-	return db_exec(db, query, 4, 
-		db_param_string(apelido),
-		db_param_string(nome),
-		db_param_string(nascimento),
-		db_param_string_array(stack, stack_count)
+// prepared statements handles, see pessoas_prepare()
+struct{
+	int select_search;
+	int select_uuid;
+	int select_all;
+	int select_apelidos;
+	int count_total;
+	int select_search_doc;
+	int select_uuid_doc;
+}pessoas_statements = { -1, -1, -1, -1, -1, -1, -1 };
+
+// register pessoas statements on the db. Call before db_connect(). false if any failed
+bool pessoas_prepare(db_t *db){
+	pessoas_statements.select_search = db_prepare(db, "pessoas_select_search", 
+		"select id, apelido, nome, nascimento, stack "
+		"from pessoas "
+		"where search like $1 "
+		"limit $2;",
+		2
+	);
+
+	pessoas_statements.select_uuid = db_prepare(db, "pessoas_select_uuid", 
+		"select id, apelido, nome, nascimento, stack "
+		"from pessoas "
+		"where id = $1",
+		1
+	);
+
+	pessoas_statements.select_all = db_prepare(db, "pessoas_select_all", 
+		"select id, apelido, nome, nascimento, stack "
+		"from pessoas",
+		0
+	);
+
+	pessoas_statements.select_apelidos = db_prepare(db, "pessoas_select_apelidos", 
+		"select apelido "
+		"from pessoas",
+		0
 	);
+
+	pessoas_statements.count_total = db_prepare(db, "pessoas_count_total", 
+		"select total::text from pessoas_contagem where id = 1;",					// bigint, the db layer reads integers as int
+		0
+	);
+
+	return
+		(pessoas_statements.select_search != -1) &&
+		(pessoas_statements.select_uuid != -1) &&
+		(pessoas_statements.select_all != -1) &&
+		(pessoas_statements.select_apelidos != -1) &&
+		(pessoas_statements.count_total != -1);
 }
 
-// search
-db_results_t *pessoas_select_search(db_t *db, char *searchParam, unsigned int limit){
-	char *query = "select id, apelido, nome, nascimento, stack "
+// register the statements that read the precomputed doc column, see db/init_doc.sql. Only when SERVER_JSON_DOC is on. Call before db_connect(). false if any failed
+bool pessoas_prepare_doc(db_t *db){
+	pessoas_statements.select_search_doc = db_prepare(db, "pessoas_select_search_doc", 
+		"select coalesce(json_agg(doc), '[]') "
+		"from ("
+			"select doc "
+			"from pessoas "
+			"where search like $1 "
+			"limit $2"
+		") p;",
+		2
+	);
+
+	pessoas_statements.select_uuid_doc = db_prepare(db, "pessoas_select_uuid_doc", 
+		"select doc "
 		"from pessoas "
-		"where search like $1 "
-		"limit $2;";
+		"where id = $1",
+		1
+	);
+
+	return
+		(pessoas_statements.select_search_doc != -1) &&
+		(pessoas_statements.select_uuid_doc != -1);
+}
+
+// append a json string, null when value is NULL
+static void pessoas_json_cat_value(string *json, char *value){
+	if(value != NULL)
+		string_cat_json(json, value);
+	else
+		string_cat_bytes(json, "null", 4);
+}
+
+// append the json of a pessoa, fields in the same order as the select statements
+void pessoas_json_cat(string *json, char *id, char *apelido, char *nome, char *nascimento, size_t stack_count, char **stack){
+	string_cat_bytes(json, "{\"id\":", 6);
+	pessoas_json_cat_value(json, id);
+	string_cat_bytes(json, ",\"apelido\":", 11);
+	pessoas_json_cat_value(json, apelido);
+	string_cat_bytes(json, ",\"nome\":", 8);
+	pessoas_json_cat_value(json, nome);
+	string_cat_bytes(json, ",\"nascimento\":", 14);
+	pessoas_json_cat_value(json, nascimento);
+	string_cat_bytes(json, ",\"stack\":[", 10);
+
+	for(size_t i = 0; i < stack_count; i++){
+		if(i != 0)
+			string_cat_bytes(json, ",", 1);
 
-	return db_exec(db, query, 2, 
+		pessoas_json_cat_value(json, stack[i]);
+	}
+
+	string_cat_bytes(json, "]}", 2);
+}
+
+// search
+void pessoas_select_search(db_t *db, char *searchParam, unsigned int limit, db_callback_t callback, void *udata){
+	db_exec_prepared_async_timeout(db, pessoas_statements.select_search, PESSOAS_SEARCH_TIMEOUT, callback, udata, 2, 
 		db_param_string(searchParam),
 		db_param_integer((int*)&limit)
 	);
 }
 
 // search
-db_results_t *pessoas_select_uuid(db_t *db, char *uuid){
-	char *query = "select id, apelido, nome, nascimento, stack "
-		"from pessoas "
-		"where id = $1";
-
-	return db_exec(db, query, 1, 
+void pessoas_select_uuid(db_t *db, char *uuid, db_callback_t callback, void *udata){
+	db_exec_prepared_async(db, pessoas_statements.select_uuid, callback, udata, 1, 
 		db_param_string(uuid)
 	);
 }
 
-// count
-db_results_t *pessoas_count(db_t *db){
- 	char *query = "select count(*) from pessoas;";
+// search, one row with the json array of the found docs
+void pessoas_select_search_doc(db_t *db, char *searchParam, unsigned int limit, db_callback_t callback, void *udata){
+	db_exec_prepared_async_timeout(db, pessoas_statements.select_search_doc, PESSOAS_SEARCH_TIMEOUT, callback, udata, 2, 
+		db_param_string(searchParam),
+		db_param_integer((int*)&limit)
+	);
+}
+
+// by uuid, the doc of the pessoa if found
+void pessoas_select_uuid_doc(db_t *db, char *uuid, db_callback_t callback, void *udata){
+	db_exec_prepared_async(db, pessoas_statements.select_uuid_doc, callback, udata, 1, 
+		db_param_string(uuid)
+	);
+}
 
-	return db_exec(db, query, 0);
+// every pessoa, one row at a time. Blocks until the last row was handed to on_row
+db_results_t *pessoas_export(db_t *db, db_row_callback_t on_row, void *udata){
+	return db_exec_prepared_stream(db, pessoas_statements.select_all, on_row, udata, 0);
 }
 
-#endif
\ No newline at end of file
+#endif
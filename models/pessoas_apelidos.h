@@ -0,0 +1,268 @@
+#ifndef _PESSOAS_APELIDOS_HEADER_
+#define _PESSOAS_APELIDOS_HEADER_
+
+#include <stdio.h>
+#include "../src/db.h"
+#include "../facil.io/fio.h"
+#include "pessoas.h"
+#include "shared.h"
+
+#define PESSOAS_APELIDOS_SHARDS 16													// independent sets, each with its own lock
+#define PESSOAS_APELIDOS_BLOOM_BITS (1 << 23)										// 1MB filter, about 0.01% false positives with every shard full
+#define PESSOAS_APELIDOS_BLOOM_HASHES 7
+#define PESSOAS_APELIDOS_SLOTS 32768												// slots of a shard, fixed as the sets live in shared memory. Up to 75% are used, about 393k apelidos in all
+#define PESSOAS_APELIDOS_ARENA (PESSOAS_APELIDOS_SLOTS * 24)						// arena bytes of a shard, only fills before the slots if apelidos average over 31 bytes
+
+// set entry. offset 0 is the empty slot, the arena starts with an unused byte
+typedef struct{
+	uint32_t tag;																	// high hash bits, most mismatches stop here
+	uint32_t offset;																// length prefixed apelido in the arena
+}pessoas_apelidos_slot_t;
+
+// open addressing set with linear probing. Apelidos live in one arena as a length byte and the bytes, with no allocation per entry
+typedef struct{
+	pthread_mutex_t lock;															// robust across processes, see pessoas_apelidos_lock()
+	bool full;
+	size_t count;
+	size_t arena_len;
+	pessoas_apelidos_slot_t slots[PESSOAS_APELIDOS_SLOTS];
+	uint8_t arena[PESSOAS_APELIDOS_ARENA];
+}pessoas_apelidos_shard_t;
+
+// apelidos known by this instance, loaded from the db on start and reserved on every POST. Known ones are answered 422 here, the batch insert confirms the others.
+// Filter and shards are in the shared segment, so every worker checks the same set
+struct{
+	uint64_t *bloom;																// set bits are only added with the shard lock of the apelido held
+	pessoas_apelidos_shard_t *shards;
+}pessoas_apelidos = { NULL, NULL };
+
+// filter bit k of hash, double hashing
+static inline size_t pessoas_apelidos_bit(uint64_t hash, int k){
+	uint64_t step = (hash >> 32) | 1;
+	return (size_t)(hash + k * step) & (PESSOAS_APELIDOS_BLOOM_BITS - 1);
+}
+
+// false when apelido is surely not in the set. Lock free
+static bool pessoas_apelidos_bloom_test(uint64_t hash){
+	for(int k = 0; k < PESSOAS_APELIDOS_BLOOM_HASHES; k++){
+		size_t bit = pessoas_apelidos_bit(hash, k);
+		if(!(__atomic_load_n(&pessoas_apelidos.bloom[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63))))
+			return false;
+	}
+
+	return true;
+}
+
+// add hash to the filter
+static void pessoas_apelidos_bloom_set(uint64_t hash){
+	for(int k = 0; k < PESSOAS_APELIDOS_BLOOM_HASHES; k++){
+		size_t bit = pessoas_apelidos_bit(hash, k);
+		__atomic_fetch_or(&pessoas_apelidos.bloom[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+	}
+}
+
+// shared bytes used by the filter and the sets
+size_t pessoas_apelidos_shared_size(){
+	return PESSOAS_APELIDOS_BLOOM_BITS / 8 + sizeof(pessoas_apelidos_shard_t) * PESSOAS_APELIDOS_SHARDS + SHARED_ALIGN * 2;
+}
+
+// take the filter and the sets from the shared segment. Call once before loading or reserving, before the workers fork. false if the segment is full
+bool pessoas_apelidos_init(){
+	pessoas_apelidos.bloom = shared_alloc(PESSOAS_APELIDOS_BLOOM_BITS / 8);
+	pessoas_apelidos.shards = shared_alloc(sizeof(pessoas_apelidos_shard_t) * PESSOAS_APELIDOS_SHARDS);
+
+	if(pessoas_apelidos.bloom == NULL || pessoas_apelidos.shards == NULL){
+		printf("Not enough shared memory for the apelidos\n");
+		return false;
+	}
+
+	for(int i = 0; i < PESSOAS_APELIDOS_SHARDS; i++){
+		pessoas_apelidos.shards[i].arena_len = 1;
+
+		if(!shared_mutex_init(&pessoas_apelidos.shards[i].lock)){
+			printf("Could not set up the apelidos locks\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// put slot in the shard set without checks. shard lock must be held
+static void pessoas_apelidos_put(pessoas_apelidos_shard_t *shard, pessoas_apelidos_slot_t slot, uint64_t hash){
+	size_t mask = PESSOAS_APELIDOS_SLOTS - 1;
+	size_t i = hash & mask;
+
+	while(shard->slots[i].offset != 0)
+		i = (i + 1) & mask;
+
+	shard->slots[i] = slot;
+}
+
+// true if apelido is in shard. shard lock must be held
+static bool pessoas_apelidos_contains(pessoas_apelidos_shard_t *shard, char *apelido, size_t len, uint64_t hash){
+	size_t mask = PESSOAS_APELIDOS_SLOTS - 1;
+	uint32_t tag = (uint32_t)(hash >> 32);
+
+	for(size_t i = hash & mask; shard->slots[i].offset != 0; i = (i + 1) & mask){
+		if(shard->slots[i].tag != tag)
+			continue;
+
+		uint8_t *entry = shard->arena + shard->slots[i].offset;
+		if(entry[0] == len && memcmp(entry + 1, apelido, len) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// rebuild the set of a shard a dead worker left half changed, from the slots that still point to a whole apelido of the arena.
+// One it lost goes to the db again and comes back as taken from the insert. shard lock must be held
+static void pessoas_apelidos_repair(pessoas_apelidos_shard_t *shard){
+	pessoas_apelidos_slot_t *slots = malloc(sizeof(shard->slots));
+	if(slots != NULL)
+		memcpy(slots, shard->slots, sizeof(shard->slots));
+
+	memset(shard->slots, 0, sizeof(shard->slots));
+	shard->count = 0;
+
+	if(shard->arena_len > PESSOAS_APELIDOS_ARENA)
+		shard->arena_len = PESSOAS_APELIDOS_ARENA;
+
+	for(size_t i = 0; slots != NULL && i < PESSOAS_APELIDOS_SLOTS; i++){
+		uint32_t offset = slots[i].offset;
+		if(offset == 0 || offset >= shard->arena_len || offset + 1 + shard->arena[offset] > shard->arena_len)
+			continue;
+
+		uint8_t *entry = shard->arena + offset;
+		uint64_t hash = fio_risky_hash(entry + 1, entry[0], 0);
+		if(slots[i].tag != (uint32_t)(hash >> 32) || pessoas_apelidos_contains(shard, (char*)entry + 1, entry[0], hash))
+			continue;
+
+		pessoas_apelidos_put(shard, slots[i], hash);
+		pessoas_apelidos_bloom_set(hash);											// the dead add may have stopped before its bits
+		shard->count++;
+	}
+
+	free(slots);
+	printf("Apelidos shard rebuilt with [%lu] apelidos, a worker died while changing it\n", shard->count);
+}
+
+// lock a shard. The lock is a robust process shared mutex, so a worker killed while holding it does not block the others, the next one to lock rebuilds the shard
+static void pessoas_apelidos_lock(pessoas_apelidos_shard_t *shard){
+	if(shared_mutex_lock(&shard->lock))
+		pessoas_apelidos_repair(shard);
+}
+
+// add apelido unless known. false if it already was. true without storing it when it is over 255 bytes or the shard is full, the insert answers 422 for those
+static bool pessoas_apelidos_add(char *apelido){
+	size_t len = strlen(apelido);
+	if(len > 255)
+		return true;
+
+	uint64_t hash = fio_risky_hash(apelido, len, 0);
+	pessoas_apelidos_shard_t *shard = &pessoas_apelidos.shards[(hash >> 40) % PESSOAS_APELIDOS_SHARDS];
+
+	pessoas_apelidos_lock(shard);
+
+	if(pessoas_apelidos_bloom_test(hash) && pessoas_apelidos_contains(shard, apelido, len, hash)){	// most new apelidos skip the probe
+		shared_mutex_unlock(&shard->lock);
+		return false;
+	}
+
+	if((shard->count + 1) * 4 > PESSOAS_APELIDOS_SLOTS * 3 || shard->arena_len + len + 1 > PESSOAS_APELIDOS_ARENA){	// full, duplicates go to the db and come back as taken from the insert
+		if(!shard->full)
+			printf("Apelidos shard full after [%lu] apelidos, new ones are checked by the db insert only\n", shard->count);
+
+		shard->full = true;
+		shared_mutex_unlock(&shard->lock);
+		return true;
+	}
+
+	pessoas_apelidos_slot_t slot = { .tag = (uint32_t)(hash >> 32), .offset = (uint32_t)shard->arena_len };
+	shard->arena[shard->arena_len] = (uint8_t)len;
+	memcpy(shard->arena + shard->arena_len + 1, apelido, len);
+	shard->arena_len += len + 1;
+
+	pessoas_apelidos_put(shard, slot, hash);
+	pessoas_apelidos_bloom_set(hash);
+	shard->count++;
+
+	shared_mutex_unlock(&shard->lock);
+	return true;
+}
+
+// reserve an apelido for a new row. false if it is already taken
+bool pessoas_apelido_reserve(char *apelido){
+	return pessoas_apelidos_add(apelido);
+}
+
+// forget the reservation of a row that could not be written, so the apelido can be sent again. Its arena bytes and filter bits stay
+void pessoas_apelido_release(char *apelido){
+	size_t len = strlen(apelido);
+	if(len > 255)
+		return;
+
+	uint64_t hash = fio_risky_hash(apelido, len, 0);
+	pessoas_apelidos_shard_t *shard = &pessoas_apelidos.shards[(hash >> 40) % PESSOAS_APELIDOS_SHARDS];
+	size_t mask = PESSOAS_APELIDOS_SLOTS - 1;
+	uint32_t tag = (uint32_t)(hash >> 32);
+
+	pessoas_apelidos_lock(shard);
+
+	size_t i = hash & mask;
+	for(; shard->slots[i].offset != 0; i = (i + 1) & mask){
+		uint8_t *entry = shard->arena + shard->slots[i].offset;
+		if(shard->slots[i].tag == tag && entry[0] == len && memcmp(entry + 1, apelido, len) == 0)
+			break;
+	}
+
+	if(shard->slots[i].offset == 0){
+		shared_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	// pull back the slots after the hole that probed past it, lookups stop at the first empty slot
+	for(size_t j = (i + 1) & mask; shard->slots[j].offset != 0; j = (j + 1) & mask){
+		uint8_t *entry = shard->arena + shard->slots[j].offset;
+		size_t home = fio_risky_hash(entry + 1, entry[0], 0) & mask;
+
+		if(((j - home) & mask) >= ((j - i) & mask)){
+			shard->slots[i] = shard->slots[j];
+			i = j;
+		}
+	}
+
+	shard->slots[i].offset = 0;
+	shard->count--;
+
+	shared_mutex_unlock(&shard->lock);
+}
+
+// apelido load row callback
+static bool pessoas_apelidos_on_row(db_results_t *row, void *udata){
+	char *apelido = db_results_read_string(row, 0, 0);
+	if(apelido != NULL){
+		pessoas_apelidos_add(apelido);
+		(*(size_t*)udata)++;
+	}
+
+	return true;
+}
+
+// fill the set with the apelidos already in the db. Call after pessoas_apelidos_init() and before serving. false if the query failed
+bool pessoas_apelidos_load(db_t *db){
+	size_t count = 0;
+	db_results_t *results = db_exec_prepared_stream(db, pessoas_statements.select_apelidos, pessoas_apelidos_on_row, &count, 0);
+	bool ok = results->code == db_error_code_ok;
+
+	if(ok)
+		printf("Loaded [%lu] apelidos\n", count);
+	else
+		printf("Could not load apelidos. Database: %s\n", db_results_message(results));
+
+	db_results_destroy(results);
+	return ok;
+}
+
+#endif
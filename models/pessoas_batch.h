@@ -0,0 +1,413 @@
+#ifndef _PESSOAS_BATCH_HEADER_
+#define _PESSOAS_BATCH_HEADER_
+
+#include <stdio.h>
+#include <time.h>
+#include "../src/db.h"
+#include "../src/string+.h"
+#include "../facil.io/fio.h"
+#include "uuid.h"
+#include "pessoas_apelidos.h"
+
+#define PESSOAS_BATCH_ROWS 64														// rows per flush, also the biggest insert statement
+#define PESSOAS_BATCH_INTERVAL 5													// ms between flushes
+#define PESSOAS_BATCH_STATEMENTS 7													// inserts of 1, 2, 4 ... PESSOAS_BATCH_ROWS rows
+#define PESSOAS_BATCH_PARAMS 5														// params per row
+#define PESSOAS_BATCH_TRIES 5														// sends of a row before it is given up
+#define PESSOAS_BATCH_BACKOFF 50													// ms before the first retry of a failed batch, doubles on every try
+#define PESSOAS_BATCH_SETTLE 5000													// ms shutdown waits for batches already sent
+
+// how a queued row ended
+typedef enum{
+	pessoas_batch_written,															// in the db
+	pessoas_batch_taken,															// dropped by the db, the apelido was written first by another instance or by a row its full shard did not track
+	pessoas_batch_rejected,															// the db refused the data of the row sent alone, sqlstate class 22 or 23. The apelido reservation was released
+	pessoas_batch_failed															// every try failed, the apelido reservation was released
+}pessoas_batch_result_t;
+
+struct pessoas_row_t;
+
+// called once per row when its result is known, usually from a reactor thread. The row is freed when it returns
+typedef void (*pessoas_batch_callback_t)(struct pessoas_row_t *row, pessoas_batch_result_t result, void *udata);
+
+// row waiting to be written. Strings live after it in the same allocation
+typedef struct pessoas_row_t{
+	struct pessoas_row_t *next;
+	char id[37];
+	char *apelido;
+	char *nome;
+	char *nascimento;
+	size_t stack_count;
+	char **stack;
+
+	pessoas_batch_callback_t callback;
+	void *udata;
+	int tries;
+	bool alone;																		// was in a batch the db rejected, sent by itself to find the bad row
+}pessoas_row_t;
+
+// group commit state. The flusher writes queued rows with multi row inserts and every POST is answered once its row was written
+struct{
+	db_t *db;
+	int statements[PESSOAS_BATCH_STATEMENTS];										// statements[k] inserts 1 << k rows
+
+	fio_lock_i lock;
+	pessoas_row_t *first;
+	pessoas_row_t *last;
+	size_t count;
+	uint64_t hold;																	// ms, nothing is flushed before it while backing off
+}pessoas_batch = { .statements = { -1, -1, -1, -1, -1, -1, -1 } };
+
+// monotonic ms
+static uint64_t pessoas_batch_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// register the batch insert statements. Call before db_connect(). Duplicates that slipped past the reservation (other instances) are dropped by the db and left out of the returned ids
+bool pessoas_batch_prepare(db_t *db){
+	pessoas_batch.db = db;
+
+	for(int k = 0; k < PESSOAS_BATCH_STATEMENTS; k++){
+		int rows = 1 << k;
+		string *query = string_from("insert into pessoas (id, apelido, nome, nascimento, stack) values ");
+
+		for(int r = 0; r < rows; r++){
+			int p = r * PESSOAS_BATCH_PARAMS;
+			string_cat_fmt(query, "%s($%d,$%d,$%d,$%d,$%d)", 64, r == 0 ? "" : ",", p + 1, p + 2, p + 3, p + 4, p + 5);
+		}
+
+		string_cat_raw(query, " on conflict do nothing returning id");
+
+		string *name = string_sprint("pessoas_insert_batch_%d", 40, rows);
+		pessoas_batch.statements[k] = db_prepare(db, name->raw, query->raw, rows * PESSOAS_BATCH_PARAMS);
+
+		string_destroy(name);
+		string_destroy(query);
+
+		if(pessoas_batch.statements[k] == -1)
+			return false;
+	}
+
+	return true;
+}
+
+// ------------------------------------------------------------ Flush --------------------------------------------------------------
+
+// backing off after a failed batch
+static bool pessoas_batch_held(){
+	return __atomic_load_n(&pessoas_batch.hold, __ATOMIC_RELAXED) > pessoas_batch_now();
+}
+
+// hand a row its result and free it
+static void pessoas_batch_done(pessoas_row_t *row, pessoas_batch_result_t result){
+	if(result == pessoas_batch_failed || result == pessoas_batch_rejected)
+		pessoas_apelido_release(row->apelido);
+
+	row->callback(row, result, row->udata);
+	free(row);
+}
+
+// put rows from first to last back at the front of the queue, in order. Nothing is flushed before hold
+static void pessoas_batch_requeue(pessoas_row_t *first, pessoas_row_t *last, size_t count, uint64_t hold){
+	fio_lock(&pessoas_batch.lock);
+
+	last->next = pessoas_batch.first;
+	pessoas_batch.first = first;
+	if(pessoas_batch.last == NULL)
+		pessoas_batch.last = last;
+
+	pessoas_batch.count += count;
+	if(hold > pessoas_batch.hold)
+		pessoas_batch.hold = hold;
+
+	fio_unlock(&pessoas_batch.lock);
+}
+
+// failed batch. When the db refused the data its rows go again one by one, so only the bad row is rejected. Otherwise they wait and go again, up to PESSOAS_BATCH_TRIES times
+static void pessoas_batch_retry(pessoas_row_t *rows, db_results_t *results){
+	bool rejected = results->code == db_error_code_invalid_type || results->code == db_error_code_invalid_range;	// mapped from the data and constraint sqlstate classes
+	bool single = rows->next == NULL;
+	pessoas_row_t *first = NULL;
+	pessoas_row_t *last = NULL;
+	size_t count = 0;
+	size_t failed = 0;
+	int tries = 0;
+
+	while(rows != NULL){
+		pessoas_row_t *next = rows->next;
+
+		if(rejected && single){
+			pessoas_batch_done(rows, pessoas_batch_rejected);
+			failed++;
+		}
+		else if(!rejected && ++rows->tries >= PESSOAS_BATCH_TRIES){
+			pessoas_batch_done(rows, pessoas_batch_failed);
+			failed++;
+		}
+		else{
+			rows->alone = rows->alone || rejected;
+			rows->next = NULL;
+
+			if(last != NULL)
+				last->next = rows;
+			else
+				first = rows;
+
+			last = rows;
+			count++;
+
+			if(rows->tries > tries)
+				tries = rows->tries;
+		}
+
+		rows = next;
+	}
+
+	printf("Batch insert failed, [%lu] rows go again and [%lu] were given up. Database: %s\n", count, failed, db_results_message(results));
+
+	if(first != NULL)
+		pessoas_batch_requeue(first, last, count, rejected ? 0 : pessoas_batch_now() + ((uint64_t)PESSOAS_BATCH_BACKOFF << (tries - 1)));
+}
+
+// batch insert done. Rows with their id returned were written, the others were dropped as duplicates. A failed batch goes back to the queue
+void pessoas_batch_on_results(db_results_t *results, void *udata){
+	pessoas_row_t *rows = udata;
+
+	if(results->code != db_error_code_ok){
+		pessoas_batch_retry(rows, results);
+		db_results_destroy(results);
+		return;
+	}
+
+	while(rows != NULL){
+		pessoas_row_t *next = rows->next;
+		bool written = false;
+
+		for(int64_t i = 0; i < results->entries_count && !written; i++){
+			char *id = db_results_read_string(results, i, 0);
+			written = id != NULL && strcmp(id, rows->id) == 0;
+		}
+
+		pessoas_batch_done(rows, written ? pessoas_batch_written : pessoas_batch_taken);
+		rows = next;
+	}
+
+	db_results_destroy(results);
+}
+
+// send count rows from list with statements[k]. The rows travel with the query and are freed once their results are handed out. Returns the row after the last one sent
+static pessoas_row_t *pessoas_batch_send(pessoas_row_t *rows, int k, bool wait){
+	size_t count = (size_t)1 << k;
+	db_param_t params[count * PESSOAS_BATCH_PARAMS];
+	pessoas_row_t *last = NULL;
+	pessoas_row_t *row = rows;
+
+	for(size_t r = 0; r < count; r++, last = row, row = row->next){
+		db_param_t *p = &params[r * PESSOAS_BATCH_PARAMS];
+
+		p[0] = db_param_string(row->id);
+		p[1] = db_param_string(row->apelido);
+		p[2] = db_param_string(row->nome);
+		p[3] = db_param_string(row->nascimento);
+		p[4] = db_param_string_array(row->stack, row->stack_count);
+	}
+
+	last->next = NULL;																// row is the rest, the callback may free the sent ones before this returns
+
+	if(wait)
+		pessoas_batch_on_results(db_exec_prepared_array(pessoas_batch.db, pessoas_batch.statements[k], count * PESSOAS_BATCH_PARAMS, params), rows);
+	else
+		db_exec_prepared_async_array(pessoas_batch.db, pessoas_batch.statements[k], pessoas_batch_on_results, rows, count * PESSOAS_BATCH_PARAMS, params);
+
+	return row;
+}
+
+// write up to PESSOAS_BATCH_ROWS queued rows, split in the fewest prepared inserts. Rows marked alone go in single row inserts. wait blocks until written, for when the reactor is down
+void pessoas_batch_flush(bool wait){
+	fio_lock(&pessoas_batch.lock);
+
+	pessoas_row_t *rows = pessoas_batch.first;
+	size_t count = pessoas_batch.count < PESSOAS_BATCH_ROWS ? pessoas_batch.count : PESSOAS_BATCH_ROWS;
+
+	pessoas_row_t *last = rows;
+	for(size_t r = 1; r < count; r++)
+		last = last->next;
+
+	if(count > 0){
+		pessoas_batch.first = last->next;
+		if(pessoas_batch.first == NULL)
+			pessoas_batch.last = NULL;
+
+		pessoas_batch.count -= count;
+		last->next = NULL;
+	}
+	else{
+		rows = NULL;
+	}
+
+	fio_unlock(&pessoas_batch.lock);
+
+	while(rows != NULL){
+		size_t run = 1;
+		if(!rows->alone){
+			for(pessoas_row_t *row = rows->next; row != NULL && !row->alone; row = row->next)
+				run++;
+		}
+
+		int k = 0;																	// biggest insert that fits the run
+		while(((size_t)2 << k) <= run)
+			k++;
+
+		rows = pessoas_batch_send(rows, k, wait);
+	}
+}
+
+// flush timer
+void pessoas_batch_tick(void *udata){
+	while(pessoas_batch.count > 0 && !pessoas_batch_held())
+		pessoas_batch_flush(false);
+
+	(void)udata;
+}
+
+// start flushing every PESSOAS_BATCH_INTERVAL ms. Call once the db is connected
+void pessoas_batch_start(){
+	fio_run_every(PESSOAS_BATCH_INTERVAL, 0, pessoas_batch_tick, NULL, NULL);
+}
+
+// ------------------------------------------------------------ Bulk load ----------------------------------------------------------
+
+// copy row source walking a row list
+bool pessoas_copy_next(db_param_t *row, void *udata){
+	pessoas_row_t **cursor = udata;
+	if(*cursor == NULL) return false;
+
+	row[0] = db_param_string((*cursor)->id);
+	row[1] = db_param_string((*cursor)->apelido);
+	row[2] = db_param_string((*cursor)->nome);
+	row[3] = db_param_string((*cursor)->nascimento);
+	row[4] = db_param_string_array((*cursor)->stack, (*cursor)->stack_count);
+
+	*cursor = (*cursor)->next;
+	return true;
+}
+
+// bulk load a row list with the copy protocol, for warm up, replays and big backlogs. All or nothing, rows are not freed
+db_results_t *pessoas_copy(db_t *db, pessoas_row_t *rows){
+	static char *fields[] = { "id", "apelido", "nome", "nascimento", "stack" };
+	return db_copy_in(db, "pessoas", fields, PESSOAS_BATCH_PARAMS, pessoas_copy_next, &rows);
+}
+
+// write whatever is still queued, blocking. For shutdown, in every worker once its reactor is down. Batches already sent finish first, failed ones come back to the queue. A big backlog goes in a single copy, inserts are the fallback as they skip duplicates
+void pessoas_batch_stop(){
+	if(!db_settle(pessoas_batch.db, PESSOAS_BATCH_SETTLE))
+		printf("Batches sent before shutdown still running after [%d]ms\n", PESSOAS_BATCH_SETTLE);
+
+	if(pessoas_batch.count >= PESSOAS_BATCH_ROWS){
+		fio_lock(&pessoas_batch.lock);
+		pessoas_row_t *rows = pessoas_batch.first;
+		size_t count = pessoas_batch.count;
+		fio_unlock(&pessoas_batch.lock);
+
+		db_results_t *results = pessoas_copy(pessoas_batch.db, rows);
+
+		if(results->code == db_error_code_ok){
+			fio_lock(&pessoas_batch.lock);
+			pessoas_batch.first = pessoas_batch.last = NULL;
+			pessoas_batch.count = 0;
+			fio_unlock(&pessoas_batch.lock);
+
+			while(rows != NULL){
+				pessoas_row_t *next = rows->next;
+				pessoas_batch_done(rows, pessoas_batch_written);
+				rows = next;
+			}
+		}
+		else{
+			printf("Copy of [%lu] queued rows failed, falling back to inserts. Database: %s\n", count, db_results_message(results));
+		}
+
+		db_results_destroy(results);
+	}
+
+	while(pessoas_batch.count > 0){
+		uint64_t now = pessoas_batch_now();
+		if(pessoas_batch.hold > now){												// backing off, the reactor is not there to wait for us
+			struct timespec wait = { (pessoas_batch.hold - now) / 1000, ((pessoas_batch.hold - now) % 1000) * 1000000 };
+			nanosleep(&wait, NULL);
+		}
+
+		pessoas_batch_flush(true);
+	}
+}
+
+// ------------------------------------------------------------ Insert -------------------------------------------------------------
+
+// new row with a fresh id, the strings are copied into the same allocation. Not queued, free() it when not handed to the batch
+pessoas_row_t *pessoas_row_new(char *nome, char *apelido, char *nascimento, size_t stack_count, char **stack){
+	size_t apelido_len = strlen(apelido) + 1;
+	size_t nome_len = strlen(nome) + 1;
+	size_t nascimento_len = strlen(nascimento) + 1;
+	size_t size = sizeof(pessoas_row_t) + sizeof(char*) * stack_count + apelido_len + nome_len + nascimento_len;
+
+	for(size_t i = 0; i < stack_count; i++)
+		size += strlen(stack[i]) + 1;
+
+	pessoas_row_t *row = malloc(size);
+	char *cursor = (char*)(row + 1) + sizeof(char*) * stack_count;
+
+	row->next = NULL;
+	row->callback = NULL;
+	row->udata = NULL;
+	row->tries = 0;
+	row->alone = false;
+	row->stack_count = stack_count;
+	row->stack = (char**)(row + 1);
+	uuid_v7(row->id);
+
+	row->apelido = memcpy(cursor, apelido, apelido_len);
+	cursor += apelido_len;
+	row->nome = memcpy(cursor, nome, nome_len);
+	cursor += nome_len;
+	row->nascimento = memcpy(cursor, nascimento, nascimento_len);
+	cursor += nascimento_len;
+
+	for(size_t i = 0; i < stack_count; i++){
+		size_t len = strlen(stack[i]) + 1;
+		row->stack[i] = memcpy(cursor, stack[i], len);
+		cursor += len;
+	}
+
+	return row;
+}
+
+// queue a new pessoa. Reserves apelido, generates the id and queues the row, callback gets it once written or given up. false if apelido is taken, callback is never called then
+bool pessoas_batch_insert(char *nome, char *apelido, char *nascimento, size_t stack_count, char **stack, pessoas_batch_callback_t callback, void *udata){
+	if(!pessoas_apelido_reserve(apelido))
+		return false;
+
+	pessoas_row_t *row = pessoas_row_new(nome, apelido, nascimento, stack_count, stack);
+	row->callback = callback;
+	row->udata = udata;
+
+	fio_lock(&pessoas_batch.lock);
+
+	if(pessoas_batch.last != NULL)
+		pessoas_batch.last->next = row;
+	else
+		pessoas_batch.first = row;
+
+	pessoas_batch.last = row;
+	bool full = ++pessoas_batch.count >= PESSOAS_BATCH_ROWS;
+
+	fio_unlock(&pessoas_batch.lock);
+
+	if(full && !pessoas_batch_held())												// don't wait for the timer
+		pessoas_batch_flush(false);
+
+	return true;
+}
+
+#endif
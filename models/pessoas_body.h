@@ -0,0 +1,85 @@
+#ifndef _PESSOAS_BODY_HEADER_
+#define _PESSOAS_BODY_HEADER_
+
+#include <stdbool.h>
+#include <string.h>
+#include "../facil.io/fiobj.h"
+#include "date.h"
+
+// what is wrong with a POST /pessoas body, the first field that failed
+typedef enum{
+	pessoas_body_ok = 0,
+	pessoas_body_invalid_apelido,
+	pessoas_body_invalid_nome,
+	pessoas_body_invalid_nascimento,
+	pessoas_body_invalid_stack
+}pessoas_body_error_t;
+
+// fields of a POST /pessoas body. Everything belongs to the parsed body, valid while it lives
+typedef struct{
+	char *apelido;
+	char *nome;
+	char *nascimento;
+	FIOBJ stack;																	// FIOBJ_INVALID when missing, null, not an array or empty
+	size_t stack_count;
+}pessoas_body_t;
+
+// value of field name as a string, numbers are formatted and a missing field reads "null"
+static char *pessoas_body_string(FIOBJ hash, char *name, size_t len){
+	FIOBJ key = fiobj_str_new(name, len);
+	char *value = fiobj_obj2cstr(fiobj_hash_get(hash, key)).data;
+	fiobj_free(key);
+	return value;
+}
+
+// read the fields of a POST /pessoas body and check them, the api and the loader share it
+pessoas_body_error_t pessoas_body_parse(FIOBJ hash, pessoas_body_t *body){
+	*body = (pessoas_body_t){ .stack = FIOBJ_INVALID };
+
+	body->apelido = pessoas_body_string(hash, "apelido", 7);
+	if(strlen(body->apelido) > 32)
+		return pessoas_body_invalid_apelido;
+
+	body->nome = pessoas_body_string(hash, "nome", 4);
+	if(strlen(body->nome) > 100)
+		return pessoas_body_invalid_nome;
+
+	body->nascimento = pessoas_body_string(hash, "nascimento", 10);
+	if(
+		(strlen(body->nascimento) != 10) ||
+		(!date_check(body->nascimento))
+	){
+		return pessoas_body_invalid_nascimento;
+	}
+
+	FIOBJ key = fiobj_str_new("stack", 5);
+	FIOBJ stackobj = fiobj_hash_get(hash, key);
+	fiobj_free(key);
+
+	if(
+		(stackobj == FIOBJ_INVALID) ||
+		(FIOBJ_IS_NULL(stackobj)) ||
+		(!FIOBJ_TYPE_IS(stackobj, FIOBJ_T_ARRAY)) ||
+		(fiobj_ary_count(stackobj) == 0)
+	){																				// no stack
+		return pessoas_body_ok;
+	}
+
+	size_t count = fiobj_ary_count(stackobj);
+	for(size_t i = 0; i < count; i++){
+		if(strlen(fiobj_obj2cstr(fiobj_ary_index(stackobj, i)).data) > 32)
+			return pessoas_body_invalid_stack;
+	}
+
+	body->stack = stackobj;
+	body->stack_count = count;
+	return pessoas_body_ok;
+}
+
+// stack strings of a parsed body, stack holds body->stack_count of them
+void pessoas_body_stack(pessoas_body_t *body, char **stack){
+	for(size_t i = 0; i < body->stack_count; i++)
+		stack[i] = fiobj_obj2cstr(fiobj_ary_index(body->stack, i)).data;
+}
+
+#endif
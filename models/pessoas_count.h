@@ -0,0 +1,91 @@
+#ifndef _PESSOAS_COUNT_HEADER_
+#define _PESSOAS_COUNT_HEADER_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/db.h"
+#include "../facil.io/fio.h"
+#include "pessoas.h"
+#include "shared.h"
+
+#define PESSOAS_COUNT_RECONCILE 1000												// ms between reads of the db counter table, by one worker of the instance
+
+// pessoas count of this instance. Lives in the shared segment, so every worker adds to and reads the same value
+struct{
+	volatile size_t *total;
+	volatile size_t *written;														// rows counted by this instance, only grows. Tells a reconcile which rows its read may have missed
+	size_t local[2];																// used when the segment is full, then each worker counts alone
+}pessoas_count_shared = { NULL, NULL, { 0, 0 } };
+
+// total of a count_total read, 64 bits. false if the read failed
+static bool pessoas_count_read(db_results_t *results, size_t *total){
+	char *text = results->code == db_error_code_ok ? db_results_read_string(results, 0, 0) : NULL;
+	if(text == NULL)
+		return false;
+
+	*total = (size_t)strtoull(text, NULL, 10);
+	return true;
+}
+
+// take the counter from the shared segment and seed it from the db counter table, see db/init.sql. Call before the workers fork. false if the seed query failed
+bool pessoas_count_init(db_t *db){
+	size_t *shared = shared_alloc(sizeof(size_t) * 2);
+	if(shared == NULL)
+		shared = pessoas_count_shared.local;
+
+	pessoas_count_shared.total = &shared[0];
+	pessoas_count_shared.written = &shared[1];
+
+	size_t total;
+	db_results_t *results = db_exec_prepared(db, pessoas_statements.count_total, 0);
+	if(!pessoas_count_read(results, &total)){
+		printf("Could not seed the pessoas count. Database: %s\n", db_results_message(results));
+		db_results_destroy(results);
+		return false;
+	}
+
+	*pessoas_count_shared.total = total;
+	printf("Pessoas count seeded with [%lu]\n", total);
+
+	db_results_destroy(results);
+	return true;
+}
+
+// pessoas were written
+void pessoas_count_add(size_t n){
+	fio_atomic_add(pessoas_count_shared.written, n);
+	fio_atomic_add(pessoas_count_shared.total, n);
+}
+
+// current count, O(1)
+size_t pessoas_count_get(){
+	return __atomic_load_n(pessoas_count_shared.total, __ATOMIC_RELAXED);
+}
+
+// db counter table read, udata is the written count when it was sent. The count is set to it, up with rows of other instances or down after an overcount.
+// Rows are only counted once written, so queued ones are never in it. Rows counted since the read was sent may be missing from the db total and go on top
+void pessoas_count_on_results(db_results_t *results, void *udata){
+	size_t total;
+	if(pessoas_count_read(results, &total)){
+		size_t since = __atomic_load_n(pessoas_count_shared.written, __ATOMIC_RELAXED) - (size_t)(uintptr_t)udata;
+		__atomic_store_n(pessoas_count_shared.total, total + since, __ATOMIC_RELAXED);
+	}
+
+	db_results_destroy(results);
+}
+
+// reconcile timer. Armed in every worker, only the leader reads since they all set the same shared total
+void pessoas_count_tick(void *udata){
+	if(!shared_leader())
+		return;
+
+	size_t written = __atomic_load_n(pessoas_count_shared.written, __ATOMIC_RELAXED);
+	db_exec_prepared_async(udata, pessoas_statements.count_total, pessoas_count_on_results, (void*)(uintptr_t)written, 0);
+}
+
+// reconcile with the db counter table every PESSOAS_COUNT_RECONCILE ms. Call once the db is connected
+void pessoas_count_start(db_t *db){
+	fio_run_every(PESSOAS_COUNT_RECONCILE, 0, pessoas_count_tick, db, NULL);
+}
+
+#endif
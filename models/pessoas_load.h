@@ -0,0 +1,128 @@
+#ifndef _PESSOAS_LOAD_HEADER_
+#define _PESSOAS_LOAD_HEADER_
+
+#include <stdio.h>
+#include "../src/db.h"
+#include "../facil.io/fiobj.h"
+#include "pessoas_apelidos.h"
+#include "pessoas_batch.h"
+#include "pessoas_body.h"
+
+#define PESSOAS_LOAD_CHUNK 10000													// rows per copy, a failed copy only loses its own chunk
+
+// what happened to the lines of a load
+typedef struct{
+	size_t lines;
+	size_t loaded;
+	size_t invalid;																	// not json, or not a valid POST /pessoas body
+	size_t taken;																	// apelido already in the db or earlier in the file
+	size_t failed;																	// in a chunk the db refused
+}pessoas_load_stats_t;
+
+// row of one json line, checked by the same validator as POST /pessoas. NULL if invalid
+static pessoas_row_t *pessoas_load_row(char *line, size_t len){
+	FIOBJ obj = FIOBJ_INVALID;
+	if(fiobj_json2obj(&obj, line, len) == 0 || !FIOBJ_TYPE_IS(obj, FIOBJ_T_HASH)){
+		fiobj_free(obj);
+		return NULL;
+	}
+
+	pessoas_body_t body;
+	pessoas_row_t *row = NULL;
+
+	if(pessoas_body_parse(obj, &body) == pessoas_body_ok){
+		char *stack[body.stack_count + 1];
+		pessoas_body_stack(&body, stack);
+		row = pessoas_row_new(body.nome, body.apelido, body.nascimento, body.stack_count, stack);
+	}
+
+	fiobj_free(obj);
+	return row;
+}
+
+// write rows with one copy and free them. The apelidos of a failed copy are released
+static void pessoas_load_copy(db_t *db, pessoas_row_t *rows, size_t count, pessoas_load_stats_t *stats){
+	db_results_t *results = pessoas_copy(db, rows);
+
+	if(results->code == db_error_code_ok){
+		stats->loaded += count;
+	}
+	else{
+		printf("Copy of [%lu] rows failed. Database: %s\n", count, db_results_message(results));
+		stats->failed += count;
+	}
+
+	bool failed = results->code != db_error_code_ok;
+	db_results_destroy(results);
+
+	while(rows != NULL){
+		pessoas_row_t *next = rows->next;
+		if(failed)																	// not in the db, a later post may take the apelido
+			pessoas_apelido_release(rows->apelido);
+
+		free(rows);
+		rows = next;
+	}
+}
+
+// warm up or replay: one POST /pessoas body per line of the file at path, written with copy in chunks of PESSOAS_LOAD_CHUNK.
+// Every row gets a new id. Call after pessoas_apelidos_load(), apelidos already known are skipped. false if the file could not be read or a copy failed
+bool pessoas_load(db_t *db, char *path){
+	FILE *file = fopen(path, "r");
+	if(file == NULL){
+		printf("Could not open [%s]\n", path);
+		return false;
+	}
+
+	pessoas_load_stats_t stats = { 0 };
+	pessoas_row_t *first = NULL;
+	pessoas_row_t *last = NULL;
+	size_t count = 0;
+
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+
+	while((len = getline(&line, &capacity, file)) != -1){
+		if(len <= 1)																// blank line
+			continue;
+
+		stats.lines++;
+
+		pessoas_row_t *row = pessoas_load_row(line, len);
+		if(row == NULL){
+			stats.invalid++;
+			continue;
+		}
+
+		if(!pessoas_apelido_reserve(row->apelido)){
+			stats.taken++;
+			free(row);
+			continue;
+		}
+
+		if(last != NULL)
+			last->next = row;
+		else
+			first = row;
+
+		last = row;
+
+		if(++count == PESSOAS_LOAD_CHUNK){
+			pessoas_load_copy(db, first, count, &stats);
+			first = last = NULL;
+			count = 0;
+		}
+	}
+
+	if(count > 0)
+		pessoas_load_copy(db, first, count, &stats);
+
+	free(line);
+	fclose(file);
+
+	printf("Loaded [%lu] of [%lu] pessoas. Invalid: [%lu], apelido taken: [%lu], failed: [%lu]\n", stats.loaded, stats.lines, stats.invalid, stats.taken, stats.failed);
+	return stats.failed == 0;
+}
+
+#endif
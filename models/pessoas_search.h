@@ -0,0 +1,593 @@
+#ifndef _PESSOAS_SEARCH_HEADER_
+#define _PESSOAS_SEARCH_HEADER_
+
+#include <stdio.h>
+#include <pthread.h>
+#include "../src/db.h"
+#include "../src/string+.h"
+#include "../facil.io/fio.h"
+#include "pessoas.h"
+#include "uuid.h"
+#include "shared.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PESSOAS_SEARCH_LIMIT 50														// results of a search, same as the db query
+#define PESSOAS_SEARCH_GRAMS 8192													// first capacity of the trigram map, doubles at 50% load
+#define PESSOAS_SEARCH_DOCS 4096													// first capacity of the docs array
+#define PESSOAS_SEARCH_SYNC 1000													// ms between reads of the rows written by other instances, done by one worker of the instance
+#define PESSOAS_SEARCH_SYNC_MARGIN 3000												// ms a row may commit after its id was made, queued and retried rows commit late
+#define PESSOAS_SEARCH_CHANNEL "pessoas_search"										// new pessoas sent to the other workers of the instance
+
+// indexed pessoa
+typedef struct{
+	uint8_t id[16];
+	char *search;																	// lower(nome || apelido || stack joined by ' '), as the search column of db/init.sql
+	char *json;
+	uint32_t length;
+}pessoas_search_doc_t;
+
+// posting list of a trigram. Doc ids ascending, stored as varint deltas
+typedef struct{
+	uint32_t gram;																	// the 3 bytes, 0 is the empty slot as text has no zero bytes
+	uint32_t count;
+	uint32_t last;																	// last doc id + 1, the base of the next delta
+	uint32_t len;
+	uint32_t size;
+	uint8_t *data;
+}pessoas_search_posting_t;
+
+// trigram inverted index of this process. Readers share the lock, adds take it alone.
+// Every worker holds its own copy: rows written here are sent to the other workers, rows of other instances are read back from the db by the leader worker
+struct{
+	bool enabled;
+	pthread_rwlock_t lock;
+
+	pessoas_search_doc_t *docs;
+	size_t docs_count;
+	size_t docs_capacity;
+
+	uint32_t *ids;																	// open addressing set of doc + 1 by id, so a pessoa is indexed once however it arrives
+	size_t ids_capacity;
+
+	uint64_t synced;																// unix ms, rows with ids made before it minus the margin are indexed
+	volatile uint8_t syncing;
+	int select_since;
+
+	pessoas_search_posting_t *grams;												// open addressing map of trigram to posting list
+	size_t grams_count;
+	size_t grams_capacity;
+}pessoas_search = { .enabled = false, .lock = PTHREAD_RWLOCK_INITIALIZER, .select_since = -1 };
+
+// thread reused buffers of a search, decoded candidates and the response
+typedef struct{
+	uint32_t *candidates;
+	uint32_t *list;
+	uint32_t *out;
+	size_t capacity;
+	string *term;
+	string *json;
+}pessoas_search_buffers_t;
+
+static __thread pessoas_search_buffers_t pessoas_search_buffers = { NULL, NULL, NULL, 0, NULL, NULL };
+
+// start the index empty. Call once before loading or adding
+void pessoas_search_init(){
+	pessoas_search.docs_capacity = PESSOAS_SEARCH_DOCS;
+	pessoas_search.docs = malloc(pessoas_search.docs_capacity * sizeof(pessoas_search_doc_t));
+
+	pessoas_search.grams_capacity = PESSOAS_SEARCH_GRAMS;
+	pessoas_search.grams = calloc(pessoas_search.grams_capacity, sizeof(pessoas_search_posting_t));
+
+	pessoas_search.ids_capacity = PESSOAS_SEARCH_DOCS * 2;
+	pessoas_search.ids = calloc(pessoas_search.ids_capacity, sizeof(uint32_t));
+
+	pessoas_search.enabled = true;
+}
+
+// ascii lower case, other bytes are kept. Same as lower() for the ascii range
+static inline char pessoas_search_lower(char c){
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// trigram at text
+static inline uint32_t pessoas_search_gram(const char *text){
+	return ((uint32_t)(uint8_t)text[0] << 16) | ((uint32_t)(uint8_t)text[1] << 8) | (uint32_t)(uint8_t)text[2];
+}
+
+// slot of gram in map, or the empty slot where it goes
+static size_t pessoas_search_slot(pessoas_search_posting_t *grams, size_t capacity, uint32_t gram){
+	size_t mask = capacity - 1;
+	size_t i = (gram * 2654435761u) & mask;
+
+	while(grams[i].gram != 0 && grams[i].gram != gram)
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+// posting list of gram, NULL if no doc has it. Read or write lock must be held
+static pessoas_search_posting_t *pessoas_search_posting(uint32_t gram){
+	pessoas_search_posting_t *posting = &pessoas_search.grams[pessoas_search_slot(pessoas_search.grams, pessoas_search.grams_capacity, gram)];
+	return posting->gram != 0 ? posting : NULL;
+}
+
+// posting list of gram, created if new. Write lock must be held
+static pessoas_search_posting_t *pessoas_search_posting_new(uint32_t gram){
+	if((pessoas_search.grams_count + 1) * 2 > pessoas_search.grams_capacity){
+		size_t capacity = pessoas_search.grams_capacity * 2;
+		pessoas_search_posting_t *grams = calloc(capacity, sizeof(pessoas_search_posting_t));
+
+		for(size_t i = 0; i < pessoas_search.grams_capacity; i++){
+			if(pessoas_search.grams[i].gram != 0)
+				grams[pessoas_search_slot(grams, capacity, pessoas_search.grams[i].gram)] = pessoas_search.grams[i];
+		}
+
+		free(pessoas_search.grams);
+		pessoas_search.grams = grams;
+		pessoas_search.grams_capacity = capacity;
+	}
+
+	pessoas_search_posting_t *posting = &pessoas_search.grams[pessoas_search_slot(pessoas_search.grams, pessoas_search.grams_capacity, gram)];
+	if(posting->gram == 0){
+		posting->gram = gram;
+		pessoas_search.grams_count++;
+	}
+
+	return posting;
+}
+
+// slot of id in the id set, or the empty slot where it goes. Write lock must be held
+static size_t pessoas_search_id_slot(uint32_t *ids, size_t capacity, uint8_t *id){
+	size_t mask = capacity - 1;
+	size_t i = fio_risky_hash(id, 16, 0) & mask;
+
+	while(ids[i] != 0 && memcmp(pessoas_search.docs[ids[i] - 1].id, id, 16) != 0)
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+// put doc in the id set, growing it at 50% load. Write lock must be held
+static void pessoas_search_id_put(uint32_t doc){
+	if((pessoas_search.docs_count + 1) * 2 > pessoas_search.ids_capacity){
+		size_t capacity = pessoas_search.ids_capacity * 2;
+		uint32_t *ids = calloc(capacity, sizeof(uint32_t));
+
+		for(size_t i = 0; i < pessoas_search.ids_capacity; i++){
+			if(pessoas_search.ids[i] != 0)
+				ids[pessoas_search_id_slot(ids, capacity, pessoas_search.docs[pessoas_search.ids[i] - 1].id)] = pessoas_search.ids[i];
+		}
+
+		free(pessoas_search.ids);
+		pessoas_search.ids = ids;
+		pessoas_search.ids_capacity = capacity;
+	}
+
+	pessoas_search.ids[pessoas_search_id_slot(pessoas_search.ids, pessoas_search.ids_capacity, pessoas_search.docs[doc].id)] = doc + 1;
+}
+
+// append doc to a posting list as a varint delta. Write lock must be held
+static void pessoas_search_posting_add(pessoas_search_posting_t *posting, uint32_t doc){
+	if(posting->len + 5 > posting->size){
+		posting->size = posting->size ? posting->size * 2 : 16;
+		posting->data = realloc(posting->data, posting->size);
+	}
+
+	uint32_t delta = doc + 1 - posting->last;
+	while(delta >= 0x80){
+		posting->data[posting->len++] = (uint8_t)(delta | 0x80);
+		delta >>= 7;
+	}
+	posting->data[posting->len++] = (uint8_t)delta;
+
+	posting->last = doc + 1;
+	posting->count++;
+}
+
+// decode a posting list into out, which holds at least count ids. Returns the count
+static size_t pessoas_search_posting_decode(pessoas_search_posting_t *posting, uint32_t *out){
+	uint32_t current = 0;
+	size_t n = 0;
+
+	for(uint32_t p = 0; p < posting->len;){
+		uint32_t delta = 0;
+		int shift = 0;
+
+		while(posting->data[p] & 0x80){
+			delta |= (uint32_t)(posting->data[p++] & 0x7f) << shift;
+			shift += 7;
+		}
+		delta |= (uint32_t)posting->data[p++] << shift;
+
+		current += delta;
+		out[n++] = current - 1;
+	}
+
+	return n;
+}
+
+// ids in both ascending lists a and b, written to out which must not be a or b. Returns the count
+static size_t pessoas_search_intersect(uint32_t *a, size_t a_count, uint32_t *b, size_t b_count, uint32_t *out){
+	size_t i = 0, j = 0, n = 0;
+
+#ifdef __SSE2__
+	// blocks of 4 against 4, every rotation of b compared with a at once
+	while(i + 4 <= a_count && j + 4 <= b_count){
+		__m128i va = _mm_loadu_si128((__m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((__m128i*)(b + j));
+
+		__m128i match = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+			_mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))))
+		);
+
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(match));
+		for(int k = 0; k < 4; k++){
+			if(mask & (1 << k))
+				out[n++] = a[i + k];
+		}
+
+		uint32_t a_max = a[i + 3];
+		uint32_t b_max = b[j + 3];
+		if(a_max <= b_max)
+			i += 4;
+		if(b_max <= a_max)
+			j += 4;
+	}
+#endif
+
+	while(i < a_count && j < b_count){
+		if(a[i] < b[j])
+			i++;
+		else if(a[i] > b[j])
+			j++;
+		else{
+			out[n++] = a[i];
+			i++;
+			j++;
+		}
+	}
+
+	return n;
+}
+
+// add a pessoa to the index. nome NULL makes the search column NULL in the db, so such rows are never found there either. false if it was not added, already indexed included
+bool pessoas_search_add(char *id, char *apelido, char *nome, char *nascimento, size_t stack_count, char **stack){
+	uint8_t key[16];
+	if(!pessoas_search.enabled || nome == NULL || apelido == NULL || id == NULL || !uuid_parse(id, key))
+		return false;
+
+	string *search = string_new_sized(256);
+	string_cat_raw(search, nome);
+	string_cat_raw(search, apelido);
+	for(size_t i = 0; i < stack_count; i++){
+		if(i != 0)
+			string_cat_bytes(search, " ", 1);
+
+		string_cat_raw(search, stack[i]);
+	}
+
+	for(size_t i = 0; i < search->len; i++)
+		search->raw[i] = pessoas_search_lower(search->raw[i]);
+
+	string *json = string_new_sized(256);
+	pessoas_json_cat(json, id, apelido, nome, nascimento, stack_count, stack);
+
+	// distinct trigrams of the text
+	size_t grams_count = search->len >= 3 ? search->len - 2 : 0;
+	uint32_t grams[grams_count + 1];
+	for(size_t i = 0; i < grams_count; i++)
+		grams[i] = pessoas_search_gram(search->raw + i);
+
+	for(size_t i = 1; i < grams_count; i++){										// insertion sort, texts are short
+		uint32_t gram = grams[i];
+		size_t k = i;
+		for(; k > 0 && grams[k - 1] > gram; k--)
+			grams[k] = grams[k - 1];
+		grams[k] = gram;
+	}
+
+	pthread_rwlock_wrlock(&pessoas_search.lock);
+
+	if(pessoas_search.ids[pessoas_search_id_slot(pessoas_search.ids, pessoas_search.ids_capacity, key)] != 0){
+		pthread_rwlock_unlock(&pessoas_search.lock);
+		string_destroy(search);
+		string_destroy(json);
+		return false;
+	}
+
+	if(pessoas_search.docs_count == pessoas_search.docs_capacity){
+		pessoas_search.docs_capacity *= 2;
+		pessoas_search.docs = realloc(pessoas_search.docs, pessoas_search.docs_capacity * sizeof(pessoas_search_doc_t));
+	}
+
+	uint32_t doc = (uint32_t)pessoas_search.docs_count;
+	pessoas_search.docs[doc] = (pessoas_search_doc_t){ .search = search->raw, .json = json->raw, .length = (uint32_t)json->len };
+	memcpy(pessoas_search.docs[doc].id, key, 16);
+	pessoas_search_id_put(doc);
+	pessoas_search.docs_count++;
+
+	for(size_t i = 0; i < grams_count; i++){
+		if(i == 0 || grams[i] != grams[i - 1])
+			pessoas_search_posting_add(pessoas_search_posting_new(grams[i]), doc);
+	}
+
+	pthread_rwlock_unlock(&pessoas_search.lock);
+
+	search->managed = false;														// raw buffers are now owned by the index
+	json->managed = false;
+	string_destroy(search);
+	string_destroy(json);
+	return true;
+}
+
+// send a pessoa to the other workers of the instance, fields as nul terminated strings one after the other
+static void pessoas_search_publish(char *id, char *apelido, char *nome, char *nascimento, size_t stack_count, char **stack){
+	string *message = string_new_sized(256);
+	char *fields[] = { id, apelido, nome, nascimento };
+
+	for(int i = 0; i < 4; i++)
+		string_cat_bytes(message, fields[i], strlen(fields[i]) + 1);
+
+	for(size_t i = 0; i < stack_count; i++)
+		string_cat_bytes(message, stack[i], strlen(stack[i]) + 1);
+
+	fio_publish(
+		.engine = FIO_PUBSUB_SIBLINGS,
+		.channel = { .data = PESSOAS_SEARCH_CHANNEL, .len = strlen(PESSOAS_SEARCH_CHANNEL) },
+		.message = { .data = message->raw, .len = message->len }
+	);
+
+	string_destroy(message);
+}
+
+// pessoa sent by another worker
+static void pessoas_search_on_message(fio_msg_s *msg){
+	char *cursor = msg->msg.data;
+	char *end = msg->msg.data + msg->msg.len;
+
+	size_t count = 0;
+	for(char *c = cursor; c < end; c++)
+		count += *c == '\0';
+
+	if(count < 4)
+		return;
+
+	char *fields[count];
+	for(size_t i = 0; i < count; i++){
+		fields[i] = cursor;
+		cursor += strlen(cursor) + 1;
+	}
+
+	pessoas_search_add(fields[0], fields[1], fields[2], fields[3], count - 4, fields + 4);
+}
+
+// a pessoa was written by this worker, index it and send it to the others
+void pessoas_search_written(char *id, char *apelido, char *nome, char *nascimento, size_t stack_count, char **stack){
+	if(pessoas_search_add(id, apelido, nome, nascimento, stack_count, stack))
+		pessoas_search_publish(id, apelido, nome, nascimento, stack_count, stack);
+}
+
+// make sure the candidate buffers hold count ids
+static void pessoas_search_reserve(pessoas_search_buffers_t *buffers, size_t count){
+	if(buffers->capacity >= count)
+		return;
+
+	buffers->capacity = count * 2;
+	buffers->candidates = realloc(buffers->candidates, buffers->capacity * sizeof(uint32_t));
+	buffers->list = realloc(buffers->list, buffers->capacity * sizeof(uint32_t));
+	buffers->out = realloc(buffers->out, buffers->capacity * sizeof(uint32_t));
+}
+
+// search term as a substring of the search text, up to limit pessoas as a json array. Buffer reused by the calling thread, length is set to its size. Valid until the next call on the same thread, do not free
+char *pessoas_search_find(char *term, size_t limit, size_t *length){
+	pessoas_search_buffers_t *buffers = &pessoas_search_buffers;
+
+	if(buffers->term == NULL){
+		buffers->term = string_new_sized(128);
+		buffers->json = string_new_sized(16384);
+	}
+
+	buffers->term->len = 0;
+	string_cat_bytes(buffers->term, term, strlen(term));
+	for(size_t i = 0; i < buffers->term->len; i++)
+		buffers->term->raw[i] = pessoas_search_lower(buffers->term->raw[i]);
+
+	string *json = buffers->json;
+	json->len = 0;
+	string_cat_bytes(json, "[", 1);
+
+	size_t len = buffers->term->len;
+	size_t found = 0;
+
+	pthread_rwlock_rdlock(&pessoas_search.lock);
+
+	if(len < 3){																	// no trigram to look up, scan every doc
+		for(size_t d = 0; d < pessoas_search.docs_count && found < limit; d++){
+			if(strstr(pessoas_search.docs[d].search, buffers->term->raw) == NULL)
+				continue;
+
+			if(found++ != 0)
+				string_cat_bytes(json, ",", 1);
+			string_cat_bytes(json, pessoas_search.docs[d].json, pessoas_search.docs[d].length);
+		}
+	}
+	else{
+		// posting lists of the term, rarest first
+		size_t lists_count = len - 2;
+		pessoas_search_posting_t *lists[lists_count];
+		bool missing = false;
+
+		for(size_t i = 0; i < lists_count && !missing; i++){
+			lists[i] = pessoas_search_posting(pessoas_search_gram(buffers->term->raw + i));
+			missing = lists[i] == NULL;
+		}
+
+		if(!missing){
+			for(size_t i = 1; i < lists_count; i++){
+				pessoas_search_posting_t *list = lists[i];
+				size_t k = i;
+				for(; k > 0 && lists[k - 1]->count > list->count; k--)
+					lists[k] = lists[k - 1];
+				lists[k] = list;
+			}
+
+			pessoas_search_reserve(buffers, lists[lists_count - 1]->count);			// the longest list, every buffer fits any of them
+			size_t count = pessoas_search_posting_decode(lists[0], buffers->candidates);
+
+			for(size_t i = 1; i < lists_count && count > 0; i++){
+				if(lists[i] == lists[i - 1])											// repeated trigram in the term
+					continue;
+
+				size_t list_count = pessoas_search_posting_decode(lists[i], buffers->list);
+				count = pessoas_search_intersect(buffers->candidates, count, buffers->list, list_count, buffers->out);
+
+				uint32_t *swap = buffers->candidates;
+				buffers->candidates = buffers->out;
+				buffers->out = swap;
+			}
+
+			// trigrams only say the term may be there, check the text
+			for(size_t c = 0; c < count && found < limit; c++){
+				pessoas_search_doc_t *doc = &pessoas_search.docs[buffers->candidates[c]];
+				if(strstr(doc->search, buffers->term->raw) == NULL)
+					continue;
+
+				if(found++ != 0)
+					string_cat_bytes(json, ",", 1);
+				string_cat_bytes(json, doc->json, doc->length);
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&pessoas_search.lock);
+
+	string_cat_bytes(json, "]", 1);
+
+	*length = json->len;
+	return json->raw;
+}
+
+// index load row callback, rows come as select_all returns them
+static bool pessoas_search_on_row(db_results_t *row, void *udata){
+	uint32_t stack_count = 0;
+	char **stack = db_results_read_string_array(row, 0, 4, &stack_count);
+
+	pessoas_search_add(
+		db_results_read_string(row, 0, 0),
+		db_results_read_string(row, 0, 1),
+		db_results_read_string(row, 0, 2),
+		db_results_read_string(row, 0, 3),
+		stack != NULL ? stack_count : 0,
+		stack
+	);
+
+	(*(size_t*)udata)++;
+	return true;
+}
+
+// fill the index with the pessoas already in the db. Call after pessoas_search_init() and before serving. false if the query failed
+bool pessoas_search_load(db_t *db){
+	size_t count = 0;
+	uint64_t started = uuid_now_ms();
+	db_results_t *results = pessoas_export(db, pessoas_search_on_row, &count);
+	bool ok = results->code == db_error_code_ok;
+
+	if(ok)
+		pessoas_search.synced = started;
+
+	if(ok)
+		printf("Indexed [%lu] pessoas for search\n", count);
+	else
+		printf("Could not load the search index. Database: %s\n", db_results_message(results));
+
+	db_results_destroy(results);
+	return ok;
+}
+
+// register the statement of the sync. Call before db_connect(), only when the index is on
+bool pessoas_search_prepare(db_t *db){
+	pessoas_search.select_since = db_prepare(db, "pessoas_select_since", 
+		"select id, apelido, nome, nascimento, stack "
+		"from pessoas "
+		"where id > $1",
+		1
+	);
+
+	return pessoas_search.select_since != -1;
+}
+
+// sync read done, udata is the unix ms it was sent. New rows are indexed and sent to the other workers
+static void pessoas_search_on_sync(db_results_t *results, void *udata){
+	if(results->code == db_error_code_ok){
+		size_t added = 0;
+
+		for(uint32_t r = 0; r < results->entries_count; r++){
+			uint32_t stack_count = 0;
+			char **stack = db_results_read_string_array(results, r, 4, &stack_count);
+			char *fields[4];
+
+			for(int f = 0; f < 4; f++)
+				fields[f] = db_results_read_string(results, r, f);
+
+			if(!pessoas_search_add(fields[0], fields[1], fields[2], fields[3], stack != NULL ? stack_count : 0, stack))
+				continue;
+
+			pessoas_search_publish(fields[0], fields[1], fields[2], fields[3], stack != NULL ? stack_count : 0, stack);
+			added++;
+		}
+
+		uint64_t started = (uint64_t)(uintptr_t)udata;
+		if(started > pessoas_search.synced)
+			pessoas_search.synced = started;
+
+		if(added > 0)
+			printf("Search index synced [%lu] pessoas from the db\n", added);
+	}
+	else{
+		printf("Search index sync failed. Database: %s\n", db_results_message(results));
+	}
+
+	db_results_destroy(results);
+	__atomic_store_n(&pessoas_search.syncing, 0, __ATOMIC_RELEASE);
+}
+
+// read the rows with ids made since the last sync, minus the margin. One read at a time
+static void pessoas_search_sync(db_t *db){
+	if(__atomic_exchange_n(&pessoas_search.syncing, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	char since[37];
+	uint64_t started = uuid_now_ms();
+	uuid_v7_floor(pessoas_search.synced > PESSOAS_SEARCH_SYNC_MARGIN ? pessoas_search.synced - PESSOAS_SEARCH_SYNC_MARGIN : 0, since);
+
+	db_exec_prepared_async(db, pessoas_search.select_since, pessoas_search_on_sync, (void*)(uintptr_t)started, 1, 
+		db_param_string(since)
+	);
+}
+
+// sync timer, only the leader worker reads, the others get its rows as messages
+static void pessoas_search_tick(void *udata){
+	if(shared_leader())
+		pessoas_search_sync(udata);
+}
+
+// in every worker once its db is connected. Listens for the pessoas of the other workers, catches up with the rows written since the index was loaded
+// before the fork, a respawned worker included, then leaves the sync to the leader
+void pessoas_search_start(db_t *db){
+	if(!pessoas_search.enabled)
+		return;
+
+	fio_subscribe(
+		.channel = { .data = PESSOAS_SEARCH_CHANNEL, .len = strlen(PESSOAS_SEARCH_CHANNEL) },
+		.on_message = pessoas_search_on_message
+	);
+
+	pessoas_search_sync(db);
+	fio_run_every(PESSOAS_SEARCH_SYNC, 0, pessoas_search_tick, db, NULL);
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef _PESSOAS_SEARCH_CACHE_HEADER_
+#define _PESSOAS_SEARCH_CACHE_HEADER_
+
+#include <time.h>
+#include "../src/string+.h"
+#include "../facil.io/fio.h"
+#include "shared.h"
+
+// what a search should do after pessoas_search_cache_lookup()
+typedef enum{
+	pessoas_search_cache_hit,														// json was copied out, answer now
+	pessoas_search_cache_wait,														// same term already queried, the waiter is resumed with its result
+	pessoas_search_cache_lead,														// query it, the waiter was registered and pessoas_search_cache_complete() hands out the result
+	pessoas_search_cache_bypass														// slot busy with another term, query without the cache
+}pessoas_search_cache_result_t;
+
+// one cached term. Terms are kept as the db sees them, since like is case sensitive no other normalization is safe
+typedef struct{
+	fio_lock_i lock;
+	uint64_t hash;
+	char *term;
+	string *json;																	// NULL until a query for term succeeded
+	size_t generation;																// insert generation when the query started
+	uint64_t stamp;																	// ms when the query started
+	bool flying;
+	void **waiters;
+	size_t waiters_count;
+	size_t waiters_capacity;
+}pessoas_search_cache_slot_t;
+
+// direct mapped cache of search responses, one per worker. Entries are fresh for stale_ms after their query, an insert in any worker of the instance ends that early
+struct{
+	pessoas_search_cache_slot_t *slots;
+	size_t capacity;																// power of two, 0 when disabled
+	size_t stale_ms;
+	volatile size_t *generation;													// bumped on every accepted insert, in the shared segment
+	size_t local;																	// used when the segment is full, then only inserts of this worker are seen
+}pessoas_search_cache = { NULL, 0, 0, &pessoas_search_cache.local, 0 };
+
+// monotonic ms
+static uint64_t pessoas_search_cache_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// allocate at least entries slots. 0 leaves the cache disabled. Call once before the workers fork, after shared_init()
+void pessoas_search_cache_init(size_t entries, size_t stale_ms){
+	if(entries == 0)
+		return;
+
+	size_t *generation = shared_alloc(sizeof(size_t));
+	if(generation != NULL)
+		pessoas_search_cache.generation = generation;
+
+	size_t capacity = 1;
+	while(capacity < entries)
+		capacity *= 2;
+
+	pessoas_search_cache.slots = calloc(capacity, sizeof(pessoas_search_cache_slot_t));
+	pessoas_search_cache.capacity = capacity;
+	pessoas_search_cache.stale_ms = stale_ms;
+}
+
+// a pessoa was accepted, results cached before now may miss it
+void pessoas_search_cache_bump(){
+	fio_atomic_add(pessoas_search_cache.generation, 1);
+}
+
+// add a waiter to a flying slot. Slot lock must be held
+static void pessoas_search_cache_wait_on(pessoas_search_cache_slot_t *slot, void *waiter){
+	if(slot->waiters_count == slot->waiters_capacity){
+		slot->waiters_capacity = slot->waiters_capacity ? slot->waiters_capacity * 2 : 8;
+		slot->waiters = realloc(slot->waiters, slot->waiters_capacity * sizeof(void*));
+	}
+
+	slot->waiters[slot->waiters_count++] = waiter;
+}
+
+// look term up. On hit the response is copied to json. On wait and lead the waiter is kept until the query of term completes
+pessoas_search_cache_result_t pessoas_search_cache_lookup(char *term, string *json, void *waiter){
+	if(pessoas_search_cache.capacity == 0)
+		return pessoas_search_cache_bypass;
+
+	size_t len = strlen(term);
+	uint64_t hash = fio_risky_hash(term, len, 0);
+	pessoas_search_cache_slot_t *slot = &pessoas_search_cache.slots[hash & (pessoas_search_cache.capacity - 1)];
+	uint64_t now = pessoas_search_cache_now();
+	size_t generation = __atomic_load_n(pessoas_search_cache.generation, __ATOMIC_ACQUIRE);
+
+	fio_lock(&slot->lock);
+
+	bool same = slot->term != NULL && slot->hash == hash && strcmp(slot->term, term) == 0;
+
+	if(same && slot->flying){
+		pessoas_search_cache_wait_on(slot, waiter);
+		fio_unlock(&slot->lock);
+		return pessoas_search_cache_wait;
+	}
+
+	if(same && slot->json != NULL && now - slot->stamp <= pessoas_search_cache.stale_ms && slot->generation == generation){	// inserts of other instances only show through the age bound
+		string_cat_bytes(json, slot->json->raw, slot->json->len);
+		fio_unlock(&slot->lock);
+		return pessoas_search_cache_hit;
+	}
+
+	if(slot->flying){																// another term is being queried here
+		fio_unlock(&slot->lock);
+		return pessoas_search_cache_bypass;
+	}
+
+	if(!same){
+		free(slot->term);
+		slot->term = strdup(term);
+		slot->hash = hash;
+	}
+
+	string_destroy(slot->json);
+	slot->json = NULL;
+	slot->generation = generation;
+	slot->stamp = now;
+	slot->flying = true;
+	slot->waiters_count = 0;
+	pessoas_search_cache_wait_on(slot, waiter);
+
+	fio_unlock(&slot->lock);
+	return pessoas_search_cache_lead;
+}
+
+// query of term finished. json is cached when not NULL. Returns the waiters to answer, free the array
+void **pessoas_search_cache_complete(char *term, char *json, size_t length, size_t *waiters_count){
+	uint64_t hash = fio_risky_hash(term, strlen(term), 0);
+	pessoas_search_cache_slot_t *slot = &pessoas_search_cache.slots[hash & (pessoas_search_cache.capacity - 1)];
+
+	fio_lock(&slot->lock);
+
+	void **waiters = slot->waiters;
+	*waiters_count = slot->waiters_count;
+
+	slot->waiters = NULL;
+	slot->waiters_count = 0;
+	slot->waiters_capacity = 0;
+	slot->flying = false;
+
+	if(json != NULL){
+		slot->json = string_new_sized(length + 1);
+		string_cat_bytes(slot->json, json, length);
+	}
+
+	fio_unlock(&slot->lock);
+	return waiters;
+}
+
+#endif
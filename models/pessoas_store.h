@@ -0,0 +1,290 @@
+#ifndef _PESSOAS_STORE_HEADER_
+#define _PESSOAS_STORE_HEADER_
+
+#include <stdio.h>
+#include <sched.h>
+#include "../src/string+.h"
+#include "../facil.io/fio.h"
+#include "uuid.h"
+#include "pessoas.h"
+#include "shared.h"
+
+#define PESSOAS_STORE_SHARDS 16														// independent tables, each with its own lock
+#define PESSOAS_STORE_ENTRY 512														// slab size, responses that do not fit are not stored
+#define PESSOAS_STORE_READ_TRIES 8													// optimistic reads before a reader takes the lock
+
+// stored response of one pessoa, a fixed size slab. Free when length is 0
+typedef struct{
+	uint8_t key[16];
+	uint64_t hash;
+	uint32_t length;
+	uint32_t next_free;																// next free entry + 1, 0 ends the list
+	volatile uint8_t referenced;													// clock bit, set on every hit and cleared as the hand passes
+	char json[PESSOAS_STORE_ENTRY - 40];
+}pessoas_store_entry_t;
+
+// index slot, entry + 1 so 0 is the empty slot
+typedef struct{
+	uint32_t hash;
+	uint32_t entry;
+}pessoas_store_slot_t;
+
+// open addressing index with linear probing over a slab of entries. Entries are evicted with the clock algorithm once the slab is full.
+// Writers take lock and make sequence odd while they change the shard, readers copy without the lock and retry if sequence moved.
+// The lock is robust: a worker killed inside a write leaves the shard half changed, the next one to lock it empties the shard
+typedef struct{
+	pthread_mutex_t lock;
+	volatile uint32_t sequence;
+	size_t capacity;																// index slots, power of two and at least twice the entries
+	size_t entries_count;
+	size_t count;
+	size_t hand;
+	uint32_t free_first;															// first free entry + 1
+	pessoas_store_slot_t *slots;
+	pessoas_store_entry_t *entries;
+}pessoas_store_shard_t;
+
+// serialized GET /pessoas/:id responses of this instance, keyed by the binary uuid. Everything lives in the shared segment, so every worker reads and fills the same store
+struct{
+	bool enabled;
+	pessoas_store_shard_t *shards;
+}pessoas_store = { false, NULL };
+
+// thread reused buffers, the hit copy and the json built from fields
+static __thread string *pessoas_store_buffer = NULL;
+static __thread string *pessoas_store_json = NULL;
+
+// take about budget bytes for the store from the shared segment. 0 leaves it disabled. Call once before the workers fork. false if the segment is full
+bool pessoas_store_init(size_t budget){
+	size_t entries = budget / PESSOAS_STORE_SHARDS / (sizeof(pessoas_store_entry_t) + 4 * sizeof(pessoas_store_slot_t));
+	if(entries < 64)
+		return true;
+
+	size_t capacity = 64;
+	while(capacity < entries * 2)
+		capacity *= 2;
+
+	pessoas_store.shards = shared_alloc(sizeof(pessoas_store_shard_t) * PESSOAS_STORE_SHARDS);
+	if(pessoas_store.shards == NULL)
+		return false;
+
+	for(int i = 0; i < PESSOAS_STORE_SHARDS; i++){
+		pessoas_store_shard_t *shard = &pessoas_store.shards[i];
+
+		shard->slots = shared_alloc(capacity * sizeof(pessoas_store_slot_t));
+		shard->entries = shared_alloc(entries * sizeof(pessoas_store_entry_t));
+		if(shard->slots == NULL || shard->entries == NULL)
+			return false;
+
+		shard->capacity = capacity;
+		shard->entries_count = entries;
+
+		for(size_t e = 0; e < entries; e++)
+			shard->entries[e].next_free = e + 1 < entries ? e + 2 : 0;
+		shard->free_first = 1;
+
+		if(!shared_mutex_init(&shard->lock))
+			return false;
+	}
+
+	pessoas_store.enabled = true;
+	return true;
+}
+
+// drop every entry of a shard a dead worker left half changed, it only holds copies of db rows. shard lock must be held
+static void pessoas_store_clear(pessoas_store_shard_t *shard){
+	if((__atomic_load_n(&shard->sequence, __ATOMIC_ACQUIRE) & 1) == 0)
+		__atomic_add_fetch(&shard->sequence, 1, __ATOMIC_ACQ_REL);				// odd, readers retry
+
+	memset(shard->slots, 0, shard->capacity * sizeof(pessoas_store_slot_t));
+
+	for(size_t e = 0; e < shard->entries_count; e++){
+		shard->entries[e].length = 0;
+		shard->entries[e].next_free = e + 1 < shard->entries_count ? e + 2 : 0;
+	}
+
+	shard->free_first = 1;
+	shard->count = 0;
+	shard->hand = 0;
+
+	__atomic_add_fetch(&shard->sequence, 1, __ATOMIC_ACQ_REL);					// even again
+	printf("Store shard cleared, a worker died while writing it\n");
+}
+
+// lock a shard, emptied first when the last owner died holding it
+static void pessoas_store_lock(pessoas_store_shard_t *shard){
+	if(shared_mutex_lock(&shard->lock))
+		pessoas_store_clear(shard);
+}
+
+// index slot of key, or of the empty slot that ends its probe. Probes stop after capacity slots, a reader may see a half changed index
+static size_t pessoas_store_find(pessoas_store_shard_t *shard, uint8_t *key, uint64_t hash){
+	size_t mask = shard->capacity - 1;
+	size_t i = hash & mask;
+
+	for(size_t probes = 0; probes < shard->capacity && shard->slots[i].entry != 0; probes++){
+		uint32_t entry = shard->slots[i].entry - 1;
+
+		if(shard->slots[i].hash == (uint32_t)hash && entry < shard->entries_count && memcmp(shard->entries[entry].key, key, 16) == 0)
+			break;
+
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+// free index slot i and its entry, then pull back the slots after it that probed past it, so lookups never need tombstones. shard lock must be held
+static void pessoas_store_remove(pessoas_store_shard_t *shard, size_t i){
+	size_t mask = shard->capacity - 1;
+	pessoas_store_entry_t *entry = &shard->entries[shard->slots[i].entry - 1];
+
+	entry->length = 0;
+	entry->next_free = shard->free_first;
+	shard->free_first = shard->slots[i].entry;
+	shard->count--;
+
+	for(size_t j = (i + 1) & mask; shard->slots[j].entry != 0; j = (j + 1) & mask){
+		size_t home = shard->slots[j].hash & mask;
+
+		if(((j - home) & mask) >= ((j - i) & mask)){								// home is at or before the hole, the slot may move into it
+			shard->slots[i] = shard->slots[j];
+			i = j;
+		}
+	}
+
+	shard->slots[i].entry = 0;
+}
+
+// advance the clock hand over the entries until one without a recent hit is found and evict it. shard lock must be held, count above 0
+static void pessoas_store_evict(pessoas_store_shard_t *shard){
+	while(true){
+		pessoas_store_entry_t *entry = &shard->entries[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->entries_count;
+
+		if(entry->length == 0)
+			continue;
+
+		if(entry->referenced){
+			entry->referenced = 0;
+			continue;
+		}
+
+		pessoas_store_remove(shard, pessoas_store_find(shard, entry->key, entry->hash));
+		return;
+	}
+}
+
+// store the response of pessoa id. Replaces an entry with the same id, invalid ids and responses over the slab size are ignored
+void pessoas_store_put(char *id, char *json, size_t length){
+	uint8_t key[16];
+	if(!pessoas_store.enabled || length == 0 || length > sizeof(((pessoas_store_entry_t*)0)->json) || !uuid_parse(id, key))
+		return;
+
+	uint64_t hash = fio_risky_hash(key, 16, 0);
+	pessoas_store_shard_t *shard = &pessoas_store.shards[(hash >> 32) % PESSOAS_STORE_SHARDS];
+
+	pessoas_store_lock(shard);
+	__atomic_add_fetch(&shard->sequence, 1, __ATOMIC_ACQ_REL);					// odd, readers retry
+
+	size_t i = pessoas_store_find(shard, key, hash);
+	if(shard->slots[i].entry != 0)
+		pessoas_store_remove(shard, i);
+
+	while(shard->free_first == 0)
+		pessoas_store_evict(shard);
+
+	uint32_t e = shard->free_first;
+	pessoas_store_entry_t *entry = &shard->entries[e - 1];
+	shard->free_first = entry->next_free;
+
+	memcpy(entry->key, key, 16);
+	entry->hash = hash;
+	entry->length = (uint32_t)length;
+	entry->referenced = 0;
+	memcpy(entry->json, json, length);
+
+	i = pessoas_store_find(shard, key, hash);
+	shard->slots[i].hash = (uint32_t)hash;
+	shard->slots[i].entry = e;
+	shard->count++;
+
+	__atomic_add_fetch(&shard->sequence, 1, __ATOMIC_ACQ_REL);					// even again
+	shared_mutex_unlock(&shard->lock);
+}
+
+// store the response of a new pessoa
+void pessoas_store_put_fields(char *id, char *apelido, char *nome, char *nascimento, size_t stack_count, char **stack){
+	if(!pessoas_store.enabled)
+		return;
+
+	if(pessoas_store_json == NULL)
+		pessoas_store_json = string_new_sized(512);
+
+	string *json = pessoas_store_json;
+	json->len = 0;
+
+	pessoas_json_cat(json, id, apelido, nome, nascimento, stack_count, stack);
+
+	pessoas_store_put(id, json->raw, json->len);
+}
+
+// copy the entry of key to the thread buffer. false if not stored
+static bool pessoas_store_copy(pessoas_store_shard_t *shard, uint8_t *key, uint64_t hash){
+	pessoas_store_slot_t slot = shard->slots[pessoas_store_find(shard, key, hash)];
+	if(slot.entry == 0 || slot.entry > shard->entries_count)
+		return false;
+
+	pessoas_store_entry_t *entry = &shard->entries[slot.entry - 1];
+	uint32_t length = entry->length;
+	if(length == 0 || length > sizeof(entry->json))
+		return false;
+
+	pessoas_store_buffer->len = 0;
+	string_cat_bytes(pessoas_store_buffer, entry->json, length);
+	entry->referenced = 1;
+	return true;
+}
+
+// stored response of pessoa id, copied to a buffer reused by the calling thread. NULL if not stored. Valid until the next call on the same thread, do not free
+char *pessoas_store_get(char *id, size_t *length){
+	uint8_t key[16];
+	if(!pessoas_store.enabled || !uuid_parse(id, key))
+		return NULL;
+
+	uint64_t hash = fio_risky_hash(key, 16, 0);
+	pessoas_store_shard_t *shard = &pessoas_store.shards[(hash >> 32) % PESSOAS_STORE_SHARDS];
+
+	if(pessoas_store_buffer == NULL)
+		pessoas_store_buffer = string_new_sized(PESSOAS_STORE_ENTRY);
+
+	bool found = false;
+	bool consistent = false;
+
+	for(int tries = 0; tries < PESSOAS_STORE_READ_TRIES && !consistent; tries++){
+		uint32_t sequence = __atomic_load_n(&shard->sequence, __ATOMIC_ACQUIRE);
+		if(sequence & 1){															// writer inside
+			sched_yield();
+			continue;
+		}
+
+		found = pessoas_store_copy(shard, key, hash);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		consistent = __atomic_load_n(&shard->sequence, __ATOMIC_RELAXED) == sequence;
+	}
+
+	if(!consistent){																// busy shard, read under the writers lock
+		pessoas_store_lock(shard);
+		found = pessoas_store_copy(shard, key, hash);
+		shared_mutex_unlock(&shard->lock);
+	}
+
+	if(!found)
+		return NULL;
+
+	*length = pessoas_store_buffer->len;
+	return pessoas_store_buffer->raw;
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef _SHARED_HEADER_
+#define _SHARED_HEADER_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define SHARED_ALIGN 64																// allocations start on their own cache line
+
+// one anonymous shared mapping made before the workers fork. Every worker sees it at the same address, so pointers into it are valid everywhere
+struct{
+	uint8_t *base;
+	size_t size;
+	size_t used;
+}shared_segment = { NULL, 0, 0 };
+
+// pid of the process running the jobs done once per instance, in the segment. 0 until one takes the role, see shared_leader()
+static volatile pid_t *shared_leader_pid = NULL;
+
+void *shared_alloc(size_t size);
+
+// map size bytes. Pages are only backed once touched. Call once before fio_start(). false if the mapping failed
+bool shared_init(size_t size){
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED){
+		printf("Could not map [%lu] bytes of shared memory\n", size);
+		return false;
+	}
+
+	shared_segment.base = base;
+	shared_segment.size = size;
+	shared_segment.used = 0;
+
+	shared_leader_pid = shared_alloc(sizeof(pid_t));
+	return true;
+}
+
+// zeroed memory from the segment, NULL when it is full. Only before fio_start(), allocations are never freed
+void *shared_alloc(size_t size){
+	size_t start = (shared_segment.used + SHARED_ALIGN - 1) & ~(size_t)(SHARED_ALIGN - 1);
+	if(shared_segment.base == NULL || start + size > shared_segment.size)
+		return NULL;
+
+	shared_segment.used = start + size;
+	return shared_segment.base + start;
+}
+
+// mutex in the segment for every worker. Robust, so a worker killed while holding it does not leave it locked for the others. Call before the workers fork. false if it could not be set up
+bool shared_mutex_init(pthread_mutex_t *mutex){
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+
+	bool ok =
+		pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED) == 0 &&
+		pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST) == 0 &&
+		pthread_mutex_init(mutex, &attributes) == 0;
+
+	pthread_mutexattr_destroy(&attributes);
+	return ok;
+}
+
+// lock a mutex from shared_mutex_init(). true when its last owner died holding it: what it guards may be half changed and the caller must repair it before use
+bool shared_mutex_lock(pthread_mutex_t *mutex){
+	if(pthread_mutex_lock(mutex) != EOWNERDEAD)
+		return false;
+
+	pthread_mutex_consistent(mutex);
+	return true;
+}
+
+// unlock a mutex from shared_mutex_init()
+void shared_mutex_unlock(pthread_mutex_t *mutex){
+	pthread_mutex_unlock(mutex);
+}
+
+// true in a single live process of the instance. The first to ask takes the role, the next to ask takes it over once that process is gone, as facil.io respawns crashed workers
+bool shared_leader(){
+	if(shared_leader_pid == NULL)
+		return true;
+
+	pid_t self = getpid();
+	pid_t leader = __atomic_load_n(shared_leader_pid, __ATOMIC_ACQUIRE);
+	if(leader == self)
+		return true;
+
+	if(leader != 0 && (kill(leader, 0) == 0 || errno != ESRCH))					// still alive
+		return false;
+
+	return __atomic_compare_exchange_n(shared_leader_pid, &leader, self, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+#endif
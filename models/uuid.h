@@ -0,0 +1,137 @@
+#ifndef _UUID_HEADER_
+#define _UUID_HEADER_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+// per thread generator state, seeded from the kernel on first use
+static __thread uint64_t uuid_state[2];
+static __thread bool uuid_seeded = false;
+static __thread uint64_t uuid_last_ms = 0;										// v7 timestamp of the last id of this thread
+static __thread uint16_t uuid_sequence = 0;										// v7 counter within the same ms, keeps ids of a thread ordered
+
+// next random 64 bits, xorshift128+
+uint64_t uuid_random(){
+	if(!uuid_seeded){
+		if(getrandom(uuid_state, sizeof(uuid_state), 0) != sizeof(uuid_state)){	// no entropy, clock and thread are still unique enough
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			uuid_state[0] = (uint64_t)now.tv_nsec ^ ((uint64_t)now.tv_sec << 32);
+			uuid_state[1] = (uint64_t)(uintptr_t)&uuid_state ^ 0x9e3779b97f4a7c15ULL;
+		}
+
+		if(uuid_state[0] == 0 && uuid_state[1] == 0)
+			uuid_state[1] = 1;
+
+		uuid_seeded = true;
+	}
+
+	uint64_t s1 = uuid_state[0];
+	uint64_t s0 = uuid_state[1];
+
+	uuid_state[0] = s0;
+	s1 ^= s1 << 23;
+	uuid_state[1] = s1 ^ s0 ^ (s1 >> 18) ^ (s0 >> 5);
+
+	return uuid_state[1] + s0;
+}
+
+// write 16 bytes as uuid text. out needs 37 bytes
+void uuid_format(const uint8_t *bytes, char *out){
+	static const char hex[] = "0123456789abcdef";
+
+	for(int i = 0; i < 16; i++){
+		if(i == 4 || i == 6 || i == 8 || i == 10)
+			*out++ = '-';
+
+		*out++ = hex[bytes[i] >> 4];
+		*out++ = hex[bytes[i] & 0x0f];
+	}
+
+	*out = '\0';
+}
+
+// read uuid text into 16 bytes. false if it is not 36 chars of hex groups 8-4-4-4-12
+bool uuid_parse(const char *text, uint8_t *bytes){
+	for(int i = 0; i < 16; i++){
+		if(i == 4 || i == 6 || i == 8 || i == 10){
+			if(*text++ != '-')
+				return false;
+		}
+
+		uint8_t byte = 0;
+		for(int n = 0; n < 2; n++, text++){
+			char c = *text;
+			uint8_t nibble;
+
+			if(c >= '0' && c <= '9')
+				nibble = c - '0';
+			else if(c >= 'a' && c <= 'f')
+				nibble = c - 'a' + 10;
+			else if(c >= 'A' && c <= 'F')
+				nibble = c - 'A' + 10;
+			else
+				return false;
+
+			byte = (byte << 4) | nibble;
+		}
+
+		bytes[i] = byte;
+	}
+
+	return *text == '\0';
+}
+
+// new time ordered uuid (v7) as text. out needs 37 bytes. Ids of the same thread always sort after the previous ones, new rows land at the right edge of a btree index instead of splitting pages all over it
+void uuid_v7(char *out){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	if(ms > uuid_last_ms){															// new ms, counter starts at a random point in its lower half
+		uuid_last_ms = ms;
+		uuid_sequence = uuid_random() & 0x7ff;
+	}
+	else if(++uuid_sequence > 0xfff){												// 4096 ids in one ms, borrow the next one
+		uuid_last_ms++;
+		uuid_sequence = 0;
+	}
+
+	uint8_t bytes[16];
+	uint64_t low = uuid_random();
+
+	for(int i = 0; i < 6; i++)														// 48 bits of unix ms, big endian
+		bytes[i] = (uint8_t)(uuid_last_ms >> (40 - i * 8));
+
+	bytes[6] = 0x70 | (uuid_sequence >> 8);											// version 7, 12 bits of counter
+	bytes[7] = (uint8_t)uuid_sequence;
+
+	memcpy(bytes + 8, &low, 8);
+	bytes[8] = (bytes[8] & 0x3f) | 0x80;											// variant 10
+
+	uuid_format(bytes, out);
+}
+
+// lowest v7 uuid of unix ms as text, every id made at or after ms sorts above it. out needs 37 bytes
+void uuid_v7_floor(uint64_t ms, char *out){
+	uint8_t bytes[16] = { 0 };
+
+	for(int i = 0; i < 6; i++)
+		bytes[i] = (uint8_t)(ms >> (40 - i * 8));
+
+	bytes[6] = 0x70;
+
+	uuid_format(bytes, out);
+}
+
+// unix ms now, the clock of v7 ids
+uint64_t uuid_now_ms(){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+#endif
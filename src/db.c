@@ -2,6 +2,8 @@
 #include "db_priv.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <time.h>
 #include <libpq-fe.h>
 #include "string+.h"
 #include "db_postgres.h"
@@ -24,7 +26,7 @@ db_results_t *db_results_new(int64_t entries, int64_t fields, db_error_code_t co
 	result->fields_count = fields;
 	result->code = code;
 
-	if(msg != NULL) memcpy(result->msg, msg, strlen(msg) + 1);
+	result->message = msg;															// callers pass literals, copied on first read
 
 	return result;
 }
@@ -46,6 +48,51 @@ db_results_t *db_results_new_fmt(int64_t entries, int64_t fields, db_error_code_
 	return result;
 }
 
+// create new result object with the arena right after it, one allocation for the whole result
+db_results_t *db_results_new_arena(size_t size){
+	db_results_t *result = malloc(sizeof(db_results_t) + sizeof(db_arena_t) + size);
+	db_arena_t *arena = (db_arena_t*)(result + 1);
+
+	memset(result, 0, sizeof(db_results_t));
+	*arena = (db_arena_t){
+		.next = NULL,
+		.size = size,
+		.used = 0,
+		.embedded = true
+	};
+
+	result->arena = arena;
+	return result;
+}
+
+// bump allocation from the results arena
+void *db_results_alloc(db_results_t *results, size_t size, size_t align){
+	db_arena_t *arena = results->arena;
+
+	if(arena != NULL){
+		size_t offset = (arena->used + align - 1) & ~(align - 1);
+
+		if(offset + size <= arena->size){
+			arena->used = offset + size;
+			return arena->data + offset;
+		}
+	}
+
+	// full, chain a new chunk in front. data is max aligned
+	size_t chunk = size > DB_ARENA_CHUNK ? size : DB_ARENA_CHUNK;
+	db_arena_t *next = malloc(sizeof(db_arena_t) + chunk);
+
+	*next = (db_arena_t){
+		.next = arena,
+		.size = chunk,
+		.used = size,
+		.embedded = false
+	};
+
+	results->arena = next;
+	return next->data;
+}
+
 // create new result object for null db
 db_results_t *db_result_new_nulldb(){
 	return db_results_new(0, 0, db_error_code_invalid_db, "Database passed was null");
@@ -54,6 +101,28 @@ db_results_t *db_result_new_nulldb(){
 // set reasult error
 void db_results_set_message(db_results_t *results, char *msg, db_vendor_t vendor, char *vendor_msg){
 	snprintf(results->msg, DB_MSG_LEN, "%s. (%s): %s\n", msg, db_vendor_name_map(vendor), vendor_msg);
+	results->message = NULL;
+}
+
+// set result error, formatted on first read
+void db_results_set_message_lazy(db_results_t *results, const char *msg, db_vendor_t vendor){
+	results->msg[0] = '\0';
+	results->message = msg;
+	results->vendor = vendor;
+}
+
+// results message
+const char *db_results_message(db_results_t *results){
+	if(results->msg[0] == '\0' && results->message != NULL){
+		const char *vendor_msg = results->borrowed != NULL ? db_results_vendor_message_function_map(results) : NULL;
+
+		if(vendor_msg != NULL)
+			snprintf(results->msg, DB_MSG_LEN, "%s. (%s): %s\n", results->message, db_vendor_name_map(results->vendor), vendor_msg);
+		else
+			snprintf(results->msg, DB_MSG_LEN, "%s", results->message);
+	}
+
+	return results->msg;
 }
 
 // ------------------------------------------------------------ Database maps ------------------------------------------------------
@@ -127,6 +196,34 @@ db_state_t db_stat_function_map(db_t *db){
 	}
 }
 
+// wait connected map
+static db_state_t db_wait_function_map(db_t *db, size_t ready, size_t timeout){
+	if(db == NULL) return db_state_invalid_db;
+	
+	switch(db->vendor){
+		default: 
+			return db_state_invalid_db;
+			
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			return db_wait_function_postgres(db, ready, timeout);
+	}
+}
+
+// settle map
+static bool db_settle_function_map(db_t *db, size_t timeout){
+	if(db == NULL) return true;
+
+	switch(db->vendor){
+		default:
+			return true;
+
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			return db_settle_function_postgres(db, timeout);
+	}
+}
+
 // close db map
 void db_destroy_function_map(db_t *db){
 	if(db == NULL) return;
@@ -147,11 +244,17 @@ void db_destroy_function_map(db_t *db){
 			db_destroy_function_postgres(db);
 	}
 
+	for(size_t i = 0; i < db->statements_count; i++){
+		free(db->statements[i].name);
+		free(db->statements[i].query);
+	}
+
+	free(db->statements);
 	free(db);
 }
 
 // exec query map
-static db_results_t *db_exec_function_map(db_t *db, void *connection, char *query, size_t params_count, va_list params){
+static db_results_t *db_exec_function_map(db_t *db, void *connection, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, size_t timeout){
 	if(db == NULL) return db_result_new_nulldb();
 
 	switch(db->vendor){
@@ -160,7 +263,107 @@ static db_results_t *db_exec_function_map(db_t *db, void *connection, char *quer
 			
 		case db_vendor_postgres:
 		case db_vendor_postgres15:
-			return db_exec_function_postgres(db, connection, query, params_count, params);
+			return db_exec_function_postgres(db, connection, statement, query, params_count, params, timeout);
+	}
+}
+
+// exec async query map
+static void db_exec_async_function_map(db_t *db, db_callback_t callback, void *udata, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, size_t timeout){
+	if(db == NULL){
+		callback(db_result_new_nulldb(), udata);
+		return;
+	}
+
+	switch(db->vendor){
+		default: 
+			callback(db_results_new(0, 0, db_error_code_invalid_db, "Vendor not yet implemented"), udata);
+			break;
+			
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			db_exec_async_function_postgres(db, callback, udata, statement, query, params_count, params, timeout);
+			break;
+	}
+}
+
+// copy in map
+static db_results_t *db_copy_in_function_map(db_t *db, void *connection, char *table, char **fields, size_t fields_count, db_copy_row_t next_row, void *udata){
+	switch(db->vendor){
+		default: 
+			return db_results_new(0, 0, db_error_code_invalid_db, "Vendor not yet implemented");
+			
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			return db_copy_in_function_postgres(db, connection, table, fields, fields_count, next_row, udata);
+	}
+}
+
+// streamed query map
+static db_results_t *db_exec_stream_function_map(db_t *db, void *connection, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, db_row_callback_t on_row, void *udata){
+	switch(db->vendor){
+		default: 
+			return db_results_new(0, 0, db_error_code_invalid_db, "Vendor not yet implemented");
+			
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			return db_exec_stream_function_postgres(db, connection, statement, query, params_count, params, on_row, udata);
+	}
+}
+
+// borrowed entry decode map
+static void db_entry_decode_function_map(db_results_t *results, db_entry_t *entry, uint32_t row, uint32_t field){
+	switch(results->vendor){
+		default:
+			entry->type = db_type_invalid;
+			break;
+
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			db_entry_decode_postgres(results, entry, row, field);
+			break;
+	}
+
+	entry->pending = false;
+}
+
+// vendor message map
+static const char *db_results_vendor_message_function_map(db_results_t *results){
+	switch(results->vendor){
+		default:
+			return NULL;
+
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			return PQresultErrorMessage(results->borrowed);
+	}
+}
+
+// borrowed results release map
+static void db_results_release_function_map(db_results_t *results){
+	switch(results->vendor){
+		default:
+			break;
+
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			PQclear(results->borrowed);
+			break;
+	}
+}
+
+// pool stats map
+static void db_pool_stats_function_map(db_t *db, size_t *queued, size_t *waiting){
+	*queued = 0;
+	*waiting = 0;
+
+	switch(db->vendor){
+		default:
+			break;
+
+		case db_vendor_postgres:
+		case db_vendor_postgres15:
+			db_pool_stats_postgres(db, queued, waiting);
+			break;
 	}
 }
 
@@ -176,6 +379,228 @@ static char *db_default_port_map(db_vendor_t vendor){
 	}
 }
 
+// ------------------------------------------------------------ Metrics ------------------------------------------------------------
+
+static pthread_mutex_t db_metrics_lock = PTHREAD_MUTEX_INITIALIZER;				// guards the shard list, never the counters
+static db_metrics_shard_t *db_metrics_shards = NULL;								// every thread that ran a query, kept after it exits so no count is lost
+static __thread db_metrics_shard_t *db_metrics_shard = NULL;
+static size_t db_metrics_inflight = 0;
+
+// error code names for metric labels
+static const char *db_metrics_error_names[db_error_code_max] = {
+	[db_error_code_ok] = "ok",
+	[db_error_code_unique_constrain_violation] = "unique_constrain_violation",
+	[db_error_code_invalid_type] = "invalid_type",
+	[db_error_code_invalid_range] = "invalid_range",
+	[db_error_code_processing] = "processing",
+	[db_error_code_info] = "info",
+	[db_error_code_fatal] = "fatal",
+	[db_error_code_connection_error] = "connection_error",
+	[db_error_code_unknown] = "unknown",
+	[db_error_code_invalid_db] = "invalid_db",
+	[db_error_code_timeout] = "timeout"
+};
+
+// monotonic clock in us
+uint64_t db_metrics_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// shard of the calling thread, registered on first use
+static db_metrics_shard_t *db_metrics_local(){
+	if(db_metrics_shard != NULL)
+		return db_metrics_shard;
+
+	db_metrics_shard = calloc(1, sizeof(db_metrics_shard_t));
+
+	pthread_mutex_lock(&db_metrics_lock);
+	db_metrics_shard->next = db_metrics_shards;
+	db_metrics_shards = db_metrics_shard;
+	pthread_mutex_unlock(&db_metrics_lock);
+
+	return db_metrics_shard;
+}
+
+// add to a counter only this thread writes, no lock prefix needed. Readers still see whole values
+static inline void db_metrics_add(uint64_t *counter, uint64_t value){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// histogram bucket of a value in us. Log linear, each power of two split in 1 << DB_METRICS_SUB_BITS
+static size_t db_metrics_bucket(uint64_t us){
+	if(us < (1 << DB_METRICS_SUB_BITS)) return us;
+
+	size_t exponent = 63 - __builtin_clzll(us);
+	size_t bucket = ((exponent - DB_METRICS_SUB_BITS + 1) << DB_METRICS_SUB_BITS) | ((us >> (exponent - DB_METRICS_SUB_BITS)) & ((1 << DB_METRICS_SUB_BITS) - 1));
+
+	return bucket < DB_METRICS_BUCKETS ? bucket : DB_METRICS_BUCKETS - 1;
+}
+
+// largest value in us that lands in a bucket
+static uint64_t db_metrics_bucket_bound(size_t bucket){
+	size_t sub = 1 << DB_METRICS_SUB_BITS;
+	if(bucket < sub) return bucket;
+
+	size_t shift = (bucket >> DB_METRICS_SUB_BITS) - 1;
+	uint64_t lower = (uint64_t)(sub | (bucket & (sub - 1))) << shift;
+	return lower + ((uint64_t)1 << shift) - 1;
+}
+
+// query started
+uint64_t db_metrics_start(){
+	__atomic_fetch_add(&db_metrics_inflight, 1, __ATOMIC_RELAXED);
+	return db_metrics_now();
+}
+
+// histogram slot of a statement
+size_t db_metrics_slot(db_t *db, db_statement_t *statement){
+	if(statement == NULL) return 0;
+
+	size_t slot = (size_t)(statement - db->statements) + 1;
+	return slot < DB_METRICS_STATEMENTS ? slot : 0;
+}
+
+// query got its connection
+void db_metrics_wait(uint64_t started){
+	db_metrics_shard_t *shard = db_metrics_local();
+	uint64_t elapsed = db_metrics_now() - started;
+
+	db_metrics_add(&shard->wait[db_metrics_bucket(elapsed)], 1);
+	db_metrics_add(&shard->wait_sum, elapsed);
+}
+
+// query finished
+void db_metrics_end(size_t slot, uint64_t started, db_error_code_t code){
+	db_metrics_shard_t *shard = db_metrics_local();
+	uint64_t elapsed = db_metrics_now() - started;
+
+	db_metrics_add(&shard->latency[slot][db_metrics_bucket(elapsed)], 1);
+	db_metrics_add(&shard->latency_sum[slot], elapsed);
+
+	if(code >= 0 && code < db_error_code_max)
+		db_metrics_add(&shard->errors[code], 1);
+
+	__atomic_fetch_sub(&db_metrics_inflight, 1, __ATOMIC_RELAXED);
+}
+
+// write a histogram in prometheus format, buckets are cumulative
+static void db_metrics_histogram(string *text, const char *name, const char *labels, uint64_t *buckets, uint64_t sum){
+	char line[256];
+	uint64_t count = 0;
+
+	for(size_t i = 0; i < DB_METRICS_BUCKETS - 1; i++){
+		count += buckets[i];
+		int len = snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%.6f\"} %lu\n", name, labels, labels[0] ? "," : "", db_metrics_bucket_bound(i) / 1e6, count);
+		string_cat_bytes(text, line, len);
+	}
+
+	count += buckets[DB_METRICS_BUCKETS - 1];
+
+	const char *open = labels[0] ? "{" : "";
+	const char *close = labels[0] ? "}" : "";
+	int len = snprintf(line, sizeof(line),
+		"%s_bucket{%s%sle=\"+Inf\"} %lu\n"
+		"%s_sum%s%s%s %.6f\n"
+		"%s_count%s%s%s %lu\n",
+		name, labels, labels[0] ? "," : "", count,
+		name, open, labels, close, sum / 1e6,
+		name, open, labels, close, count
+	);
+	string_cat_bytes(text, line, len);
+}
+
+// metrics in prometheus text format. Shards are summed as they are read, a query finishing meanwhile may show up in some counters only
+char *db_metrics_text(db_t *db, size_t *length){
+	db_metrics_shard_t *merged = calloc(1, sizeof(db_metrics_shard_t));
+
+	pthread_mutex_lock(&db_metrics_lock);
+	for(db_metrics_shard_t *shard = db_metrics_shards; shard != NULL; shard = shard->next){
+		for(size_t i = 0; i < DB_METRICS_STATEMENTS; i++){
+			for(size_t j = 0; j < DB_METRICS_BUCKETS; j++)
+				merged->latency[i][j] += __atomic_load_n(&shard->latency[i][j], __ATOMIC_RELAXED);
+
+			merged->latency_sum[i] += __atomic_load_n(&shard->latency_sum[i], __ATOMIC_RELAXED);
+		}
+
+		for(size_t j = 0; j < DB_METRICS_BUCKETS; j++)
+			merged->wait[j] += __atomic_load_n(&shard->wait[j], __ATOMIC_RELAXED);
+
+		merged->wait_sum += __atomic_load_n(&shard->wait_sum, __ATOMIC_RELAXED);
+
+		for(size_t j = 0; j < db_error_code_max; j++)
+			merged->errors[j] += __atomic_load_n(&shard->errors[j], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&db_metrics_lock);
+
+	string *text = string_new_sized(16384);
+	char line[1024];
+	int len;
+
+	// latency per statement, only the ones that ran
+	string_cat_raw(text, "# HELP db_query_duration_seconds Query latency seen by the caller, pool wait included\n# TYPE db_query_duration_seconds histogram\n");
+	for(size_t i = 0; i < DB_METRICS_STATEMENTS; i++){
+		uint64_t count = 0;
+		for(size_t j = 0; j < DB_METRICS_BUCKETS; j++)
+			count += merged->latency[i][j];
+
+		if(count == 0) continue;
+
+		const char *name = (i == 0 || db == NULL || i > db->statements_count) ? "query" : db->statements[i - 1].name;
+		snprintf(line, sizeof(line), "query=\"%s\"", name);
+		db_metrics_histogram(text, "db_query_duration_seconds", line, merged->latency[i], merged->latency_sum[i]);
+	}
+
+	string_cat_raw(text, "# HELP db_pool_wait_seconds Time blocking queries wait for a connection and async ones sit queued\n# TYPE db_pool_wait_seconds histogram\n");
+	db_metrics_histogram(text, "db_pool_wait_seconds", "", merged->wait, merged->wait_sum);
+
+	string_cat_raw(text, "# HELP db_queries_total Finished queries by result code\n# TYPE db_queries_total counter\n");
+	for(size_t j = 0; j < db_error_code_max; j++){
+		len = snprintf(line, sizeof(line), "db_queries_total{code=\"%s\"} %lu\n", db_metrics_error_names[j], merged->errors[j]);
+		string_cat_bytes(text, line, len);
+	}
+
+	size_t queued = 0;
+	size_t waiting = 0;
+	if(db != NULL)
+		db_pool_stats_function_map(db, &queued, &waiting);
+
+	size_t open = db != NULL ? __atomic_load_n(&db->context.connections_open, __ATOMIC_RELAXED) : 0;
+	size_t available = db != NULL ? __atomic_load_n(&db->context.available_connection, __ATOMIC_RELAXED) : 0;
+
+	len = snprintf(line, sizeof(line),
+		"# HELP db_queries_in_flight Queries started and not finished\n# TYPE db_queries_in_flight gauge\n"
+		"db_queries_in_flight %lu\n"
+		"# HELP db_pool_connections Pool connections by state\n# TYPE db_pool_connections gauge\n"
+		"db_pool_connections{state=\"max\"} %lu\n"
+		"db_pool_connections{state=\"min\"} %lu\n"
+		"db_pool_connections{state=\"open\"} %lu\n"
+		"db_pool_connections{state=\"free\"} %lu\n"
+		"# HELP db_pool_queued Async requests waiting for a connection\n# TYPE db_pool_queued gauge\n"
+		"db_pool_queued %lu\n"
+		"# HELP db_pool_waiting Callers blocked waiting for a connection\n# TYPE db_pool_waiting gauge\n"
+		"db_pool_waiting %lu\n",
+		__atomic_load_n(&db_metrics_inflight, __ATOMIC_RELAXED),
+		db != NULL ? db->context.connections_count : 0,
+		db != NULL ? db->context.connections_min : 0,
+		open,
+		available,
+		queued,
+		waiting
+	);
+	string_cat_bytes(text, line, len);
+
+	free(merged);
+
+	if(length != NULL) *length = text->len;
+	char *ret = text->raw;
+	text->managed = false;
+	string_destroy(text);
+
+	return ret;
+}
+
 // ------------------------------------------------------------- Public calls ------------------------------------------------------
 
 // create db object
@@ -193,6 +618,7 @@ db_t *db_create(db_vendor_t type, size_t num_connections, char *host, char *port
 	db_t *db = (db_t*)calloc(1, sizeof(db_t));
 
 	db->context.connections_count = num_connections;
+	db->context.connections_min = num_connections;
 	if(pthread_mutex_init(&(db->context.connections_lock), NULL) != 0){
 		if(code != NULL) *code = db_error_code_unknown;
 		free(db);
@@ -216,11 +642,47 @@ db_error_code_t db_connect(db_t *db){
 	return db_connect_function_map(db);
 }
 
+// set pool bounds
+void db_set_pool_size(db_t *db, size_t min, size_t max){
+	if(db == NULL || db->state != db_state_not_connected || max < 1) return;
+
+	db->context.connections_count = max;
+	db->context.connections_min = min < 1 ? 1 : (min > max ? max : min);
+}
+
+// set wire format
+void db_set_format(db_t *db, db_format_t format){
+	if(db == NULL) return;
+	db->format = format;
+}
+
+// set results mode
+void db_set_results_mode(db_t *db, db_results_mode_t mode){
+	if(db == NULL) return;
+	db->results_mode = mode;
+}
+
+// set default query timeout
+void db_set_timeout(db_t *db, size_t timeout){
+	if(db == NULL) return;
+	db->timeout = timeout;
+}
+
 // poll current db status. Use this function before accessing db->state
 db_state_t db_stat(db_t *db){
 	return db_stat_function_map(db);
 }
 
+// wait for the pool to come up
+db_state_t db_wait(db_t *db, size_t ready, size_t timeout){
+	return db_wait_function_map(db, ready, timeout);
+}
+
+// finish async queries already sent
+bool db_settle(db_t *db, size_t timeout){
+	return db_settle_function_map(db, timeout);
+}
+
 // new param for query
 db_param_t db_param_new(db_type_t type, bool is_array, size_t count, void *value, size_t size){
 	bool is_invalid = false;
@@ -370,7 +832,7 @@ db_param_t db_param_string_array(char **value, size_t count){
 // 	return db_param_new(db_type_blob, true, count, (void*)value, size_elem); 
 // }
 
-// try and get a connection
+// try and get a connection, waits up to DB_CONN_POOL_TIMEOUT when all are busy
 static void *db_request_conn(db_t *db){
 	switch(db->vendor){
 		default:
@@ -399,77 +861,254 @@ static void db_return_conn(db_t *db, void *conn){
 	}
 }
 
+// registered statement from handle. NULL if invalid
+static db_statement_t *db_statement_get(db_t *db, int statement){
+	if(db == NULL || statement < 0 || (size_t)statement >= db->statements_count) return NULL;
+	return &(db->statements[statement]);
+}
+
+// copy variadic params to an array
+static void db_params_from_va(db_param_t *array, size_t params_count, va_list params){
+	for(size_t i = 0; i < params_count; i++)
+		array[i] = va_arg(params, db_param_t);
+}
+
+// exec query or prepared statement
+static db_results_t *db_exec_params(db_t *db, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, size_t timeout){
+	uint64_t started = db_metrics_start();
+	db_results_t *res;
+
+	void *conn = db_request_conn(db);
+	db_metrics_wait(started);
+
+	if(conn == NULL){
+		res = db_results_new_fmt(0, 0, db_error_code_fatal, "Could not get connnection from connection pool in %dms. Connection available: [%lu]. Connection count: [%lu]", DB_CONN_POOL_TIMEOUT, db->context.available_connection, db->context.connections_count);
+	}
+	else{
+		res = db_exec_function_map(db, conn, statement, query, params_count, params, timeout);
+		db_return_conn(db, conn);
+	}
+
+	db_metrics_end(db_metrics_slot(db, statement), started, res->code);
+
+	return res;
+}
+
 // exec query
 db_results_t *db_exec(db_t *db, char *query, size_t params_count, ...){
+	db_param_t array[params_count + 1];
 	va_list params;
 	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
 	
-	void *conn;
-	int retries = DB_CONN_POOL_RETRY;
-	while(retries){
-		conn = db_request_conn(db);
+	db_results_t *res = db_exec_params(db, NULL, query, params_count, array, db != NULL ? db->timeout : 0);
 
-		if(conn == NULL)
-			retries--;
-		else
-			break;
-	}
+	return res;
+}
+
+// exec query without blocking
+void db_exec_async(db_t *db, db_callback_t callback, void *udata, char *query, size_t params_count, ...){
+	db_param_t array[params_count + 1];
+	va_list params;
+	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
+
+	db_exec_async_function_map(db, callback, udata, NULL, query, params_count, array, db != NULL ? db->timeout : 0);
+}
+
+// bulk load rows
+db_results_t *db_copy_in(db_t *db, char *table, char **fields, size_t fields_count, db_copy_row_t next_row, void *udata){
+	if(db == NULL) return db_result_new_nulldb();
+
+	if(table == NULL || fields == NULL || fields_count == 0 || next_row == NULL)
+		return db_results_new(0, 0, db_error_code_invalid_type, "Copy needs a table, fields and a row source");
 
-	if(retries == 0 && conn == NULL)
-		return db_results_new_fmt(0, 0, db_error_code_fatal, "Could not get connnection from connection pool. Connection available: [%lu]. Connection count: [%lu]", db->context.available_connection, db->context.connections_count);
+	void *conn = db_request_conn(db);
+	if(conn == NULL)
+		return db_results_new_fmt(0, 0, db_error_code_fatal, "Could not get connnection from connection pool in %dms. Connection available: [%lu]. Connection count: [%lu]", DB_CONN_POOL_TIMEOUT, db->context.available_connection, db->context.connections_count);
 
-	db_results_t *res = db_exec_function_map(db, conn, query, params_count, params);
+	db_results_t *res = db_copy_in_function_map(db, conn, table, fields, fields_count, next_row, udata);
 
 	db_return_conn(db, conn);
 
-	va_end(params);
 	return res;
 }
 
+// exec query or prepared statement streaming its rows
+static db_results_t *db_exec_stream_params(db_t *db, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, db_row_callback_t on_row, void *udata){
+	if(on_row == NULL)
+		return db_results_new(0, 0, db_error_code_invalid_type, "Streamed query needs a row callback");
+
+	uint64_t started = db_metrics_start();
+	db_results_t *res;
+
+	void *conn = db_request_conn(db);
+	db_metrics_wait(started);
+
+	if(conn == NULL){
+		res = db_results_new_fmt(0, 0, db_error_code_fatal, "Could not get connnection from connection pool in %dms. Connection available: [%lu]. Connection count: [%lu]", DB_CONN_POOL_TIMEOUT, db->context.available_connection, db->context.connections_count);
+	}
+	else{
+		res = db_exec_stream_function_map(db, conn, statement, query, params_count, params, on_row, udata);
+		db_return_conn(db, conn);
+	}
+
+	db_metrics_end(db_metrics_slot(db, statement), started, res->code);
+
+	return res;
+}
+
+// exec query streaming its rows
+db_results_t *db_exec_stream(db_t *db, db_row_callback_t on_row, void *udata, char *query, size_t params_count, ...){
+	if(db == NULL) return db_result_new_nulldb();
+
+	db_param_t array[params_count + 1];
+	va_list params;
+	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
+
+	return db_exec_stream_params(db, NULL, query, params_count, array, on_row, udata);
+}
+
+// register statement
+int db_prepare(db_t *db, char *name, char *query, size_t params_count){
+	if(
+		(db == NULL) ||
+		(name == NULL) ||
+		(query == NULL) ||
+		(db->state != db_state_not_connected)										// connections only learn statements while coming up
+	){
+		return -1;
+	}
+
+	db->statements = realloc(db->statements, sizeof(db_statement_t) * (db->statements_count + 1));
+	db->statements[db->statements_count] = (db_statement_t){
+		.name = strdup(name),
+		.query = strdup(query),
+		.params_count = params_count
+	};
+
+	db->statements_count++;
+	return (int)(db->statements_count - 1);
+}
+
+// exec prepared statement
+db_results_t *db_exec_prepared(db_t *db, int statement, size_t params_count, ...){
+	db_param_t array[params_count + 1];
+	va_list params;
+	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
+
+	return db_exec_prepared_array(db, statement, params_count, array);
+}
+
+// exec prepared statement with a timeout
+static db_results_t *db_exec_prepared_params(db_t *db, int statement, size_t timeout, size_t params_count, db_param_t *params){
+	db_statement_t *prepared = db_statement_get(db, statement);
+	if(prepared == NULL)
+		return db_results_new(0, 0, db_error_code_invalid_db, "Invalid prepared statement");
+
+	if(prepared->params_count != params_count)
+		return db_results_new_fmt(0, 0, db_error_code_invalid_type, "Prepared statement '%s' expects [%lu] params, got [%lu]", prepared->name, prepared->params_count, params_count);
+
+	return db_exec_params(db, prepared, NULL, params_count, params, timeout);
+}
+
+// exec prepared statement, params from an array
+db_results_t *db_exec_prepared_array(db_t *db, int statement, size_t params_count, db_param_t *params){
+	return db_exec_prepared_params(db, statement, db != NULL ? db->timeout : 0, params_count, params);
+}
+
+// exec prepared statement with its own timeout
+db_results_t *db_exec_prepared_timeout(db_t *db, int statement, size_t timeout, size_t params_count, ...){
+	db_param_t array[params_count + 1];
+	va_list params;
+	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
+
+	return db_exec_prepared_params(db, statement, timeout, params_count, array);
+}
+
+// exec prepared statement without blocking
+void db_exec_prepared_async(db_t *db, int statement, db_callback_t callback, void *udata, size_t params_count, ...){
+	db_param_t array[params_count + 1];
+	va_list params;
+	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
+
+	db_exec_prepared_async_array(db, statement, callback, udata, params_count, array);
+}
+
+// exec prepared statement without blocking with a timeout
+static void db_exec_prepared_async_params(db_t *db, int statement, size_t timeout, db_callback_t callback, void *udata, size_t params_count, db_param_t *params){
+	db_statement_t *prepared = db_statement_get(db, statement);
+	if(prepared == NULL){
+		callback(db_results_new(0, 0, db_error_code_invalid_db, "Invalid prepared statement"), udata);
+		return;
+	}
+
+	if(prepared->params_count != params_count){
+		callback(db_results_new_fmt(0, 0, db_error_code_invalid_type, "Prepared statement '%s' expects [%lu] params, got [%lu]", prepared->name, prepared->params_count, params_count), udata);
+		return;
+	}
+
+	db_exec_async_function_map(db, callback, udata, prepared, NULL, params_count, params, timeout);
+}
+
+// exec prepared statement without blocking, params from an array
+void db_exec_prepared_async_array(db_t *db, int statement, db_callback_t callback, void *udata, size_t params_count, db_param_t *params){
+	db_exec_prepared_async_params(db, statement, db != NULL ? db->timeout : 0, callback, udata, params_count, params);
+}
+
+// exec prepared statement without blocking with its own timeout
+void db_exec_prepared_async_timeout(db_t *db, int statement, size_t timeout, db_callback_t callback, void *udata, size_t params_count, ...){
+	db_param_t array[params_count + 1];
+	va_list params;
+	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
+
+	db_exec_prepared_async_params(db, statement, timeout, callback, udata, params_count, array);
+}
+
+// exec prepared statement streaming its rows
+db_results_t *db_exec_prepared_stream(db_t *db, int statement, db_row_callback_t on_row, void *udata, size_t params_count, ...){
+	db_statement_t *prepared = db_statement_get(db, statement);
+	if(prepared == NULL)
+		return db_results_new(0, 0, db_error_code_invalid_db, "Invalid prepared statement");
+
+	if(prepared->params_count != params_count)
+		return db_results_new_fmt(0, 0, db_error_code_invalid_type, "Prepared statement '%s' expects [%lu] params, got [%lu]", prepared->name, prepared->params_count, params_count);
+
+	db_param_t array[params_count + 1];
+	va_list params;
+	va_start(params, params_count);
+	db_params_from_va(array, params_count, params);
+	va_end(params);
+
+	return db_exec_stream_params(db, prepared, NULL, params_count, array, on_row, udata);
+}
+
 // destroy results
 void db_results_destroy(db_results_t *results){
 	if(results == NULL) return;
 
-	if(results->fields != NULL){
-		for(size_t i = 0; i < results->entries_count; i++){							// for each entry
-			for(size_t j = 0; j < results->fields_count; j++){						// on each columns/field
-				for(size_t elem = 0; elem < results->entries[i][j].count; elem++){	// on each element if values is array  
-					switch(results->entries[i][j].type){
-						default:
-							break;
-
-						case db_type_integer_array:
-							free( ( (int**)(results->entries[i][j].value) ) [elem]);
-							break;
-							
-						case db_type_bool_array:
-							free( ( (bool**)(results->entries[i][j].value) ) [elem]);
-							break;
-
-						case db_type_float_array:
-							free( ( (float**)(results->entries[i][j].value) ) [elem]);
-							break;
-
-						case db_type_string_array:
-							free( ( (char**)(results->entries[i][j].value) ) [elem]);
-							break;
-
-						// case db_type_blob_array:
-					}
-				}
-
-				free(results->entries[i][j].value);									// free value
-			}
-
-			free(results->entries[i]);												// free whole entry
-		}
+	if(results->borrowed != NULL)
+		db_results_release_function_map(results);
 
-		for(size_t j = 0; j < results->fields_count; j++)
-			free(results->fields[j]);												// free fields names
+	db_arena_t *arena = results->arena;
+	while(arena != NULL && !arena->embedded){										// extra chunks, the first one goes with the results
+		db_arena_t *next = arena->next;
+		free(arena);
+		arena = next;
 	}
 
-	free(results->entries);
-	free(results->fields);
 	free(results);
 }
 
@@ -573,114 +1212,197 @@ void db_print_results(db_results_t *results){
 	}
 }
 
-// print json
-char *db_json_entries(db_results_t *results, bool squash_if_single){
-	if(results->entries == NULL) return NULL;
+// two digit pairs for integer formatting
+static const char db_json_digits[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// thread reused buffers for the serializer
+static __thread string *db_json_buffer = NULL;
+static __thread string *db_json_names = NULL;
+
+// write integer in decimal
+static void db_json_cat_integer(string *json, int64_t value){
+	char buffer[24];
+	char *end = buffer + sizeof(buffer);
+	char *p = end;
+	uint64_t n = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+	while(n >= 100){
+		p -= 2;
+		memcpy(p, &db_json_digits[(n % 100) * 2], 2);
+		n /= 100;
+	}
 
-	bool trail = !(squash_if_single && results->entries_count == 1);
+	if(n >= 10){
+		p -= 2;
+		memcpy(p, &db_json_digits[n * 2], 2);
+	}else{
+		*--p = '0' + n;
+	}
 
-	string *json = string_new();
+	if(value < 0)
+		*--p = '-';
 
-	if(trail)
-		string_cat_raw(json, "[");
-	else
-		string_cat_raw(json, "{");
+	string_cat_bytes(json, p, end - p);
+}
 
-	for(size_t i = 0; i < results->entries_count; i++){
-		if(trail)
-			string_cat_raw(json, "{");
-	
-		for(size_t j = 0; j < results->fields_count; j++){
+// write float, json has no nan or infinity
+static void db_json_cat_float(string *json, float value){
+	if(!isfinite(value)){
+		string_cat_bytes(json, "null", 4);
+		return;
+	}
 
-			if(j != 0)
-				string_cat_raw(json, ",");
+	char buffer[64];
+	int len = snprintf(buffer, sizeof(buffer), "%f", value);
+	string_cat_bytes(json, buffer, len < (int)sizeof(buffer) ? len : (int)sizeof(buffer) - 1);
+}
 
-			// name
-			string_cat_fmt(json, "\"%s\":", 50, results->fields[j]);
-			
-			// value
-			switch(results->entries[i][j].type){
-				default:
-				case db_type_invalid:
-				case db_type_null:
-					string_cat_fmt(json, "null", 5);
-					break;
+// write a single value
+static void db_json_cat_entry(string *json, db_results_t *results, uint32_t i, uint32_t j){
+	db_entry_t *entry = db_results_get_entry(results, i, j);
+	if(entry == NULL){
+		string_cat_bytes(json, "null", 4);
+		return;
+	}
 
-				case db_type_integer:
-					string_cat_fmt(json, "%d", 15, *db_results_read_integer(results, i, j));
-					break;
+	switch(entry->type){
+		default:
+		case db_type_invalid:
+		case db_type_null:
+			string_cat_bytes(json, "null", 4);
+			break;
 
-				case db_type_bool:
-					string_cat_fmt(json, "%d", 15, *db_results_read_bool(results, i, j));
-					break;
-					
+		case db_type_integer:
+			db_json_cat_integer(json, *(int*)entry->value);
+			break;
 
-				case db_type_float:
-					string_cat_fmt(json, "%f", 20, *db_results_read_float(results, i, j));
-					break;
+		case db_type_bool:
+			db_json_cat_integer(json, *(bool*)entry->value);
+			break;
 
-				case db_type_string:
-					string_cat_fmt(json, "\"%s\"", 255, db_results_read_string(results, i, j));
-					break;
+		case db_type_float:
+			db_json_cat_float(json, *(float*)entry->value);
+			break;
 
-				// case db_type_blob:
+		case db_type_string:
+			string_cat_json(json, (char*)entry->value);
+			break;
 
-				case db_type_integer_array:
-				{
-					uint32_t count;
-					int **array = db_results_read_integer_array(results, i, j, &count);
+		// case db_type_blob:
 
-					string_cat_raw(json, "[");
-					for(uint32_t k = 0; k < count; k++){
-						if(k != 0)
-							string_cat_raw(json, ",");
+		case db_type_integer_array:
+		{
+			int **array = (int**)entry->value;
 
-						string_cat_fmt(json, "%d", 15, *(array[k]));
-					}
+			string_cat_bytes(json, "[", 1);
+			for(size_t k = 0; k < entry->count; k++){
+				if(k != 0)
+					string_cat_bytes(json, ",", 1);
 
-					string_cat_raw(json, "]");
-				}
-				break;
+				if(array[k] == NULL)
+					string_cat_bytes(json, "null", 4);
+				else
+					db_json_cat_integer(json, *(array[k]));
+			}
+			string_cat_bytes(json, "]", 1);
+		}
+		break;
 
-				case db_type_string_array:
-				{
-					uint32_t count;
-					char **array = db_results_read_string_array(results, i, j, &count);
+		case db_type_string_array:
+		{
+			char **array = (char**)entry->value;
 
-					string_cat_raw(json, "[");
-					for(uint32_t k = 0; k < count; k++){
-						if(k != 0)
-							string_cat_raw(json, ",");
+			string_cat_bytes(json, "[", 1);
+			for(size_t k = 0; k < entry->count; k++){
+				if(k != 0)
+					string_cat_bytes(json, ",", 1);
 
-						string_cat_fmt(json, "\"%s\"", 255, array[k]);
-					}
+				if(array[k] == NULL)
+					string_cat_bytes(json, "null", 4);
+				else
+					string_cat_json(json, array[k]);
+			}
+			string_cat_bytes(json, "]", 1);
+		}
+		break;
 
-					string_cat_raw(json, "]");
-				}
-				break;
+		// case db_type_bool_array:
+		// case db_type_float_array:
 
-				// case db_type_bool_array:
-				// case db_type_float_array:
+		// case db_type_blob_array:
+	}
+}
 
-				// case db_type_blob_array:
-			}
-		}	
+// json stringify results appending to json. Field names are escaped once, then copied for every row
+static void db_json_entries_cat(db_results_t *results, bool squash_if_single, string *json){
+	if(results->entries == NULL || json == NULL) return;
+
+	bool trail = !(squash_if_single && results->entries_count == 1);
+
+	if(db_json_names == NULL)
+		db_json_names = string_new();
+
+	// names[j] is ,"field": and the comma is skipped for the first field
+	size_t offsets[results->fields_count + 1];
+	db_json_names->len = 0;
+	for(int64_t j = 0; j < results->fields_count; j++){
+		offsets[j] = db_json_names->len;
+		string_cat_bytes(db_json_names, ",", 1);
+		string_cat_json(db_json_names, results->fields[j]);
+		string_cat_bytes(db_json_names, ":", 1);
+	}
+	offsets[results->fields_count] = db_json_names->len;
+
+	string_cat_bytes(json, trail ? "[" : "{", 1);
+
+	for(int64_t i = 0; i < results->entries_count; i++){
+		if(i != 0)
+			string_cat_bytes(json, ",", 1);
 
 		if(trail)
-			string_cat_raw(json, "}");
+			string_cat_bytes(json, "{", 1);
+
+		for(int64_t j = 0; j < results->fields_count; j++){
+			size_t skip = j == 0 ? 1 : 0;
+			string_cat_bytes(json, db_json_names->raw + offsets[j] + skip, offsets[j + 1] - offsets[j] - skip);
+			db_json_cat_entry(json, results, i, j);
+		}
 
-		if(i != (results->entries_count - 1))
-			string_cat_raw(json, ",");
+		if(trail)
+			string_cat_bytes(json, "}", 1);
 	}
 
-	if(trail)
-		string_cat_raw(json, "]");
-	else
-		string_cat_raw(json, "}");
+	string_cat_bytes(json, trail ? "]" : "}", 1);
+}
+
+// json stringify results into a buffer reused by the calling thread. Valid until the next call on the same thread, do not free
+char *db_json_entries_buffered(db_results_t *results, bool squash_if_single, size_t *length){
+	if(length != NULL) *length = 0;
+	if(results->entries == NULL) return NULL;
+
+	if(db_json_buffer == NULL)
+		db_json_buffer = string_new_sized(4096);
 
-	char *ret = strdup(json->raw);
-	string_destroy(json);
+	db_json_buffer->len = 0;
+	db_json_entries_cat(results, squash_if_single, db_json_buffer);
 
+	if(length != NULL) *length = db_json_buffer->len;
+	return db_json_buffer->raw;
+}
+
+// json stringify results from a query. Free the returned string
+char *db_json_entries(db_results_t *results, bool squash_if_single){
+	size_t length;
+	char *buffer = db_json_entries_buffered(results, squash_if_single, &length);
+	if(buffer == NULL) return NULL;
+
+	char *ret = malloc(length + 1);
+	memcpy(ret, buffer, length + 1);
 	return ret;
 }
 
@@ -689,15 +1411,18 @@ db_entry_t *db_results_get_entry(db_results_t *results, uint32_t entry, uint32_t
 	if(results->entries == NULL) return NULL;
 	if(entry >= results->entries_count) return NULL;
 	if(field >= results->fields_count) return NULL;
-	if(results->entries[entry][field].type == db_type_invalid) return NULL;
+	
+	db_entry_t *value = &(results->entries[entry][field]);
+	if(value->pending) db_entry_decode_function_map(results, value, entry, field);
+	if(value->type == db_type_invalid) return NULL;
 
-	return &(results->entries[entry][field]);
+	return value;
 }
 
 // get single entry ith type checking
 db_entry_t *db_results_get_entry_tc(db_results_t *results, uint32_t entry, uint32_t field, db_type_t type_check){
 	db_entry_t *value = db_results_get_entry(results, entry, field);
-	if(value->type != type_check) return NULL;
+	if(value == NULL || value->type != type_check) return NULL;
 	return value;
 }
 
@@ -8,7 +8,12 @@
 #include <pthread.h>
 
 #define DB_MSG_LEN 300
-#define DB_CONN_POOL_RETRY 5
+#define DB_CONN_POOL_TIMEOUT 3000												// ms a blocking query waits for a free connection
+#define DB_PIPELINE_MAX_BATCH 64
+#define DB_COPY_BUFFER 65536													// bytes buffered before each copy data message
+#define DB_POOL_CHECK_INTERVAL 100												// ms between pool maintenance runs
+#define DB_CONNECT_TIMEOUT 10000												// ms to wait for the pool to come up on start
+#define DB_POOL_IDLE_TIMEOUT 30000												// ms unused before a connection above the minimum is closed
 
 // ------------------------------------------------------------ Types --------------------------------------------------------------
 
@@ -22,6 +27,18 @@ typedef enum{
 	db_vendor_invalid
 }db_vendor_t;
 
+// wire format used for query params and results
+typedef enum{
+	db_format_text = 0,
+	db_format_binary
+}db_format_t;
+
+// how query results hold their values
+typedef enum{
+	db_results_copied = 0,															// every value decoded into the results
+	db_results_borrowed																// vendor result kept alive, values point into it and are decoded on first read
+}db_results_mode_t;
+
 // the type for the query parameter
 typedef enum{
 	db_type_invalid = -1,
@@ -53,6 +70,7 @@ typedef struct{
 	size_t count;
 	size_t size;
 	void *value;
+	bool pending;																	// borrowed value not decoded yet
 }db_entry_t;
 
 // error codes
@@ -67,6 +85,7 @@ typedef enum{
 	db_error_code_connection_error,
 	db_error_code_unknown,
 	db_error_code_invalid_db,
+	db_error_code_timeout,
 	db_error_code_max
 }db_error_code_t;
 
@@ -79,9 +98,32 @@ typedef struct{
 	db_entry_t **entries;
 
 	db_error_code_t code;
-	char msg[DB_MSG_LEN];
+	char msg[DB_MSG_LEN];													// formatted on first read, use db_results_message()
+	const char *message;													// static part of msg, the vendor message is appended when formatting
+
+	void *arena;															// fields, entries and values live here, freed with the results
+
+	db_vendor_t vendor;
+	void *borrowed;															// vendor result kept alive, borrowed values and the vendor message point into it
 }db_results_t;
 
+// called with the results of an async query. The results belong to the callback, free them with db_results_destroy()
+typedef void (*db_callback_t)(db_results_t *results, void *udata);
+
+// fills row with the next row for db_copy_in(), one param per field. false when there are no more rows
+typedef bool (*db_copy_row_t)(db_param_t *row, void *udata);
+
+// called with every row of a streamed query, row holds a single entry and is destroyed once the callback returns. Return false to stop the query
+typedef bool (*db_row_callback_t)(db_results_t *row, void *udata);
+
+// statement registered with db_prepare(), prepared on every connection of the pool
+typedef struct{
+	char *name;
+	char *query;
+	size_t params_count;
+	void *context;																	// vendor info learned when the statement is first prepared
+}db_statement_t;
+
 // current state of the db object
 typedef enum{
 	db_state_invalid_db = -1,
@@ -102,26 +144,53 @@ typedef struct{
 	char *role;
 
 	db_state_t state;
+	db_format_t format;
+	db_results_mode_t results_mode;
+	size_t timeout;																	// ms a query may run before it is cancelled, 0 never. See db_set_timeout()
+
+	db_statement_t *statements;
+	size_t statements_count;
 
 	struct{
-		pthread_mutex_t connections_lock;
-		size_t connections_count;
+		pthread_mutex_t connections_lock;											// guards the pool wait queues, never the free list
+		size_t connections_count;													// maximum, the pool grows up to it while requests queue
+		size_t connections_min;														// always kept open
+		size_t connections_open;
 		void *connections;
-		size_t available_connection;
+		size_t available_connection;												// free connections, changed atomically
+		void *pool;																	// vendor pool state: callers waiting for a connection and queued async requests
 	}context;
 }db_t;
 
 // ------------------------------------------------------------ Functions ----------------------------------------------------------
 
-// create a new db object
+// create a new db object. host may be a unix socket directory, like /var/run/postgresql, which skips the TCP stack
 db_t *db_create(db_vendor_t type, size_t num_connections, char *host, char *port, char *database, char *user, char *password, char *role, db_error_code_t *code);
 
 // connect to database 
 db_error_code_t db_connect(db_t *db);
 
+// set pool bounds, call before db_connect(). min connections are opened on connect and kept healthy, more are opened up to max while queries queue and closed again after DB_POOL_IDLE_TIMEOUT. Default is the count given to db_create() for both
+void db_set_pool_size(db_t *db, size_t min, size_t max);
+
+// set wire format for params and results. Binary skips formatting and parsing values as text on both ends. Default is db_format_text
+void db_set_format(db_t *db, db_format_t format);
+
+// set how results hold their values, db_results_copied by default. Borrowed results are cheaper when values are read once, pointers returned by them are valid until db_results_destroy()
+void db_set_results_mode(db_t *db, db_results_mode_t mode);
+
+// ms a query may take before it is cancelled on the server and answered with db_error_code_timeout, 0 never which is the default. Checked every DB_POOL_CHECK_INTERVAL, async queries queued for a connection expire too
+void db_set_timeout(db_t *db, size_t timeout);
+
 // poll current db status. Use this function before accessing db->state
 db_state_t db_stat(db_t *db);
 
+// block after db_connect() until ready connections are up, polling every one being opened at once. The rest of the pool keeps coming up in the background. db_state_connecting if timeout ms passed first
+db_state_t db_wait(db_t *db, size_t ready, size_t timeout);
+
+// block up to timeout ms until the async queries already sent got their results and callbacks. For shutdown, once the reactor that reads them is down. false if some are still running
+bool db_settle(db_t *db, size_t timeout);
+
 // close connection
 void db_destroy(db_t *db);
 
@@ -161,6 +230,42 @@ db_param_t db_param_string_array(char **value, size_t count);
 // exec a query. return is always NOT NULL, no need to check
 db_results_t *db_exec(db_t *db, char *query, size_t params_count, ...);
 
+// exec a query without blocking the caller. The connection socket is watched by the facil.io reactor and callback is called from a reactor thread once the results arrive. callback is always called, even on failure
+void db_exec_async(db_t *db, db_callback_t callback, void *udata, char *query, size_t params_count, ...);
+
+// register a statement to be prepared on every connection of the pool, including ones that reconnect. Call before db_connect(). Returns the statement handle or -1 on error
+int db_prepare(db_t *db, char *name, char *query, size_t params_count);
+
+// exec a statement registered with db_prepare(). return is always NOT NULL, no need to check
+db_results_t *db_exec_prepared(db_t *db, int statement, size_t params_count, ...);
+
+// same as db_exec_prepared() with params from an array, for statements built with a variable number of params
+db_results_t *db_exec_prepared_array(db_t *db, int statement, size_t params_count, db_param_t *params);
+
+// same as db_exec_prepared() with its own timeout in ms instead of the one from db_set_timeout()
+db_results_t *db_exec_prepared_timeout(db_t *db, int statement, size_t timeout, size_t params_count, ...);
+
+// exec a statement registered with db_prepare() without blocking the caller. Same rules as db_exec_async()
+void db_exec_prepared_async(db_t *db, int statement, db_callback_t callback, void *udata, size_t params_count, ...);
+
+// same as db_exec_prepared_async() with params from an array, for statements built with a variable number of params
+void db_exec_prepared_async_array(db_t *db, int statement, db_callback_t callback, void *udata, size_t params_count, db_param_t *params);
+
+// same as db_exec_prepared_async() with its own timeout in ms instead of the one from db_set_timeout()
+void db_exec_prepared_async_timeout(db_t *db, int statement, size_t timeout, db_callback_t callback, void *udata, size_t params_count, ...);
+
+// bulk load rows into table with the copy protocol, much faster than inserts for many rows. Rows are pulled from next_row until it returns false. All or nothing, any invalid row or constraint violation fails the whole copy
+db_results_t *db_copy_in(db_t *db, char *table, char **fields, size_t fields_count, db_copy_row_t next_row, void *udata);
+
+// exec query handing rows to on_row one at a time as they arrive, memory stays flat whatever the size of the result. Blocks the caller. The returned results only carry the outcome, no entries
+db_results_t *db_exec_stream(db_t *db, db_row_callback_t on_row, void *udata, char *query, size_t params_count, ...);
+
+// same as db_exec_stream() for a statement registered with db_prepare()
+db_results_t *db_exec_prepared_stream(db_t *db, int statement, db_row_callback_t on_row, void *udata, size_t params_count, ...);
+
+// message describing the results code, formatted on first call. Valid until db_results_destroy()
+const char *db_results_message(db_results_t *results);
+
 // read integer value from the results of a query. NULL if null | non existent | invalid. Use db_results_isvalid() | db_results_isnull() | db_results_isvalid_and_notnull() to check if the value is what you expect
 int *db_results_read_integer(db_results_t *results, uint32_t entry, uint32_t field);
 
@@ -206,7 +311,13 @@ void db_results_destroy(db_results_t *results);
 // print results from a query
 void db_print_results(db_results_t *results);
 
-// json stringify results from a query
+// query latency, pool and error metrics of this process in prometheus text format, length is set to its size. Free the returned string
+char *db_metrics_text(db_t *db, size_t *length);
+
+// json stringify results from a query. Free the returned string
 char *db_json_entries(db_results_t *results, bool squash_if_single);
 
+// json stringify results into a buffer reused by the calling thread, length is set to its size. Valid until the next call on the same thread, do not free
+char *db_json_entries_buffered(db_results_t *results, bool squash_if_single, size_t *length);
+
 #endif
\ No newline at end of file
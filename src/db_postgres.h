@@ -2,8 +2,14 @@
 #include "db_priv.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 #include <libpq-fe.h>
 #include "string+.h"
+#include "../facil.io/fio.h"
 #include "../facil.io/fiobj.h"
 #include "../facil.io/fiobj_json.h"
 
@@ -28,14 +34,173 @@ static db_error_code_t db_error_code_map_postgres(int code){
 	}
 }
 
-// connection function
-static db_error_code_t db_connect_function_postgres(db_t *db){
+// sqlstate to error code, sorted by state for bsearch
+typedef struct{
+	char state[6];
+	db_error_code_t code;
+	const char *msg;
+}db_sqlstate_postgres_t;
+
+static const db_sqlstate_postgres_t db_sqlstates_postgres[] = {
+	{ "08000", db_error_code_connection_error,				"Connection failure" },				// connection_exception
+	{ "08001", db_error_code_connection_error,				"Connection failure" },				// sqlclient_unable_to_establish_sqlconnection
+	{ "08003", db_error_code_connection_error,				"Connection failure" },				// connection_does_not_exist
+	{ "08004", db_error_code_connection_error,				"Connection failure" },				// sqlserver_rejected_establishment_of_sqlconnection
+	{ "08006", db_error_code_connection_error,				"Connection failure" },				// connection_failure
+	{ "22000", db_error_code_invalid_type,					"Invalid data for field" },			// data_exception
+	{ "22001", db_error_code_invalid_range,					"Invalid range for field" },		// string_data_right_truncation
+	{ "22003", db_error_code_invalid_range,					"Invalid range for field" },		// numeric_value_out_of_range
+	{ "22007", db_error_code_invalid_type,					"Query has invalid param syntax" },	// invalid_datetime_format
+	{ "22008", db_error_code_invalid_range,					"Invalid range for field" },		// datetime_field_overflow
+	{ "22023", db_error_code_invalid_type,					"Query has invalid param syntax" },	// invalid_parameter_value
+	{ "22P02", db_error_code_invalid_type,					"Query has invalid param syntax" },	// invalid_text_representation
+	{ "23502", db_error_code_invalid_type,					"Required field is null" },			// not_null_violation
+	{ "23505", db_error_code_unique_constrain_violation,	"Entry already in database" },		// unique_violation
+	{ "23514", db_error_code_invalid_range,					"Invalid range for field" },		// check_violation
+	{ "57014", db_error_code_timeout,						"Query cancelled, timeout expired" },	// query_canceled
+};
+
+// compare sqlstates
+static int db_sqlstate_cmp_postgres(const void *key, const void *entry){
+	return memcmp(key, ((const db_sqlstate_postgres_t*)entry)->state, 5);
+}
 
-	if(!PQisthreadsafe())
-		return db_error_code_invalid_db;
+// map a sqlstate, falls back to its class (first two chars). NULL if unknown
+static const db_sqlstate_postgres_t *db_sqlstate_map_postgres(const char *state){
+	if(state == NULL || strlen(state) != 5) return NULL;
 
-	db->state = db_state_not_connected;
+	size_t count = sizeof(db_sqlstates_postgres) / sizeof(db_sqlstates_postgres[0]);
+	const db_sqlstate_postgres_t *found = bsearch(state, db_sqlstates_postgres, count, sizeof(db_sqlstate_postgres_t), db_sqlstate_cmp_postgres);
+
+	if(found == NULL){
+		char class[5] = { state[0], state[1], '0', '0', '0' };
+		found = bsearch(class, db_sqlstates_postgres, count, sizeof(db_sqlstate_postgres_t), db_sqlstate_cmp_postgres);
+	}
+
+	return found;
+}
+
+// async request waiting on or running in a connection
+typedef struct db_request_postgres_t{
+	struct db_request_postgres_t *next;
+	char *query;
+	db_statement_t *statement;														// prepared statement, used instead of query when not NULL
+	struct db_params_postgres_t *params;
+	int result_format;
+	db_callback_t callback;
+	void *udata;
+	db_results_t *results;
+	bool results_done;																// all results read, waiting for the pipeline sync
+	size_t metric;																	// metrics slot of the statement
+	size_t deadline;																// ms, timed out once passed. 0 never
+	uint64_t started;																// us, see db_metrics_start()
+	bool abandoned;																	// timed out behind or ahead of other pipelined queries, its results are dropped
+}db_request_postgres_t;
+
+// fifo of async requests
+typedef struct{
+	db_request_postgres_t *first;
+	db_request_postgres_t *last;
+	size_t count;
+}db_queue_postgres_t;
+
+// lifecycle of a pool slot. Only ready connections are ever on the free list, the others are held by the pool maintenance
+typedef enum{
+	db_slot_closed_postgres = 0,
+	db_slot_connecting_postgres,
+	db_slot_resetting_postgres,
+	db_slot_ready_postgres
+}db_slot_postgres_t;
+
+// pooled connection. The socket is attached to the facil.io reactor on the first async query
+typedef struct db_conn_postgres_t{
+	PGconn *conn;
+	db_t *db;
+	db_slot_postgres_t slot;
+	size_t last_used;																// ms, last time it was claimed
+	fio_lock_i taken;																// owned by a caller or an async batch, free list flag
+	fio_lock_i lock;																// held by whoever is talking to the server through this connection
+	intptr_t uuid;																	// reactor uuid, -1 when not attached
+	size_t prepared;																// how many of db->statements were prepared on this connection
+	db_queue_postgres_t inflight;													// async batch sent through the pipeline, in order
+	size_t deadline;																// ms, of the query running now, 0 none. Changed atomically
+	size_t cancelled;																// deadline a cancel was already sent for
+	PGcancel *cancel;																// cancel handle of the current session
+	fio_lock_i cancel_lock;															// guards cancel, never held while talking to the server
+	PostgresPollingStatusType polling;												// last PQconnectPoll() while connecting, what to wait on the socket for
+	fio_protocol_s protocol;
+}db_conn_postgres_t;
+
+// caller blocked on db_request_conn_postgres(), lives on its stack
+typedef struct db_waiter_postgres_t{
+	struct db_waiter_postgres_t *next;
+	pthread_cond_t cond;
+	struct db_conn_postgres_t *conn;												// handed over by whoever released it
+}db_waiter_postgres_t;
+
+// pool state besides the free list. Queues are guarded by connections_lock, counters are read without it
+typedef struct{
+	db_waiter_postgres_t *waiters_first;
+	db_waiter_postgres_t *waiters_last;
+	size_t waiting;
+	db_queue_postgres_t pending;													// async requests that found every connection busy
+	size_t queued;
+
+	db_t *db;
+	fio_lock_i maintenance;															// one maintenance run at a time
+	bool armed;																		// maintenance timer scheduled
+	size_t refs;																	// the db, the maintenance timer and every deadline timer. The last one frees the pool
+	bool checked;																	// statements prepared on the first connection up
+	bool stopped;
+}db_pool_postgres_t;
+
+// append request to queue
+static inline void db_queue_push_postgres(db_queue_postgres_t *queue, db_request_postgres_t *request){
+	request->next = NULL;
+
+	if(queue->last != NULL)
+		queue->last->next = request;
+	else
+		queue->first = request;
+
+	queue->last = request;
+	queue->count++;
+}
+
+// remove first request from queue. NULL if empty
+static inline db_request_postgres_t *db_queue_pop_postgres(db_queue_postgres_t *queue){
+	db_request_postgres_t *request = queue->first;
+	if(request == NULL) return NULL;
+
+	queue->first = request->next;
+	if(queue->first == NULL)
+		queue->last = NULL;
+
+	queue->count--;
+	request->next = NULL;
+	return request;
+}
 
+// move up to max requests from the front of src to dst
+static inline void db_queue_take_postgres(db_queue_postgres_t *dst, db_queue_postgres_t *src, size_t max){
+	while(max-- > 0 && src->first != NULL)
+		db_queue_push_postgres(dst, db_queue_pop_postgres(src));
+}
+
+// new pool slot, closed and held by the pool until a connection is opened in it
+static db_conn_postgres_t *db_conn_new_postgres(db_t *db){
+	db_conn_postgres_t *pgconn = calloc(1, sizeof(db_conn_postgres_t));
+	pgconn->db = db;
+	pgconn->slot = db_slot_closed_postgres;
+	pgconn->taken = 1;
+	pgconn->lock = FIO_LOCK_INIT;
+	pgconn->cancel_lock = FIO_LOCK_INIT;
+	pgconn->uuid = -1;
+	return pgconn;
+}
+
+// start opening a connection, blocking waits for it to be established. NULL if out of memory
+static PGconn *db_conn_open_postgres(db_t *db, bool blocking){
 	const char *keys[] = {
 		"host",
 		"port",
@@ -54,120 +219,689 @@ static db_error_code_t db_connect_function_postgres(db_t *db){
 		NULL
 	};
 
-	// check first as sync
-	PGconn *conn = PQconnectdbParams((const char *const *)keys, (const char *const *)values, 0);
-	
-    if (PQstatus(conn) == CONNECTION_BAD) {
-		// db_error_set_message(db, "Connection to database failed", PQerrorMessage(conn));
-		db->state = db_state_failed_connection;
-		PQfinish(conn);
-		return db_error_code_connection_error;
-    }
-
-	// create other connections
-	PGconn **connections = calloc(db->context.connections_count, sizeof(PGconn*));
+	if(blocking)
+		return PQconnectdbParams((const char *const *)keys, (const char *const *)values, 0);
+	else
+		return PQconnectStartParams((const char *const *)keys, (const char *const *)values, 0);
+}
+
+// current time in ms, as of the reactor last tick
+static inline size_t db_now_postgres(){
+	struct timespec now = fio_last_tick();
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// connection function. Every minimum connection is started at once without blocking, db_wait() and the pool maintenance bring them up
+static db_error_code_t db_connect_function_postgres(db_t *db){
+
+	if(!PQisthreadsafe())
+		return db_error_code_invalid_db;
+
+	db->state = db_state_not_connected;
+
+	// every slot up to the maximum exists, only the minimum is opened now
+	db_conn_postgres_t **connections = calloc(db->context.connections_count, sizeof(db_conn_postgres_t*));
+	db_pool_postgres_t *pool = calloc(1, sizeof(db_pool_postgres_t));
+	pool->db = db;
+	pool->refs = 1;
+
 	db->context.connections = connections;
 	db->context.available_connection = 0;
-	connections[0] = conn;
+	db->context.connections_open = 0;
+	db->context.pool = pool;
+
+	for(size_t i = 0; i < db->context.connections_count; i++)
+		connections[i] = db_conn_new_postgres(db);
 
-	for(size_t i = 1; i < db->context.connections_count; i++){
-		connections[i] = PQconnectStartParams((const char *const *)keys, (const char *const *)values, 0);
+	for(size_t i = 0; i < db->context.connections_min; i++){
+		PGconn *conn = db_conn_open_postgres(db, false);
 
-		if(connections[i] == NULL){													// on mass creating of connections, if error, free all created ones
-			for(size_t j = i - 1; j >= 0; j--){
-				PQfinish(connections[i]);
+		if(conn == NULL || PQstatus(conn) == CONNECTION_BAD){						// on mass creating of connections, if error, close all created ones
+			PQfinish(conn);
+
+			for(size_t j = 0; j < i; j++){
+				PQfinish(connections[j]->conn);
+				connections[j]->conn = NULL;
+				connections[j]->slot = db_slot_closed_postgres;
 			}
 
+			db->context.connections_open = 0;
 			db->state = db_state_failed_connection;
-			return db_state_failed_connection;
+			return db_error_code_connection_error;
 		}
+
+		connections[i]->conn = conn;
+		connections[i]->slot = db_slot_connecting_postgres;
+		connections[i]->polling = PGRES_POLLING_WRITING;							// libpq wants the first poll once the socket is writable
+		db->context.connections_open++;
 	}
 
 	db->state = db_state_connecting;
 	return db_error_code_ok;
 }
 
-// try and get a connection
-static inline PGconn *db_request_conn_postgres(db_t *db){
-	if(db->state != db_state_connected) return NULL;
-	if(db->context.available_connection >= db->context.connections_count) return NULL;
+static void db_statement_describe_postgres(db_statement_t *statement, PGconn *conn);
+
+// prepare registered statements the connection doesn't know yet. Connection lock must be held
+static bool db_prepare_conn_postgres(db_t *db, db_conn_postgres_t *pgconn){
+	while(pgconn->prepared < db->statements_count){
+		db_statement_t *statement = &(db->statements[pgconn->prepared]);
+
+		PGresult *res = PQprepare(pgconn->conn, statement->name, statement->query, statement->params_count, NULL);
+		bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+
+		if(!ok)
+			printf("Could not prepare statement '%s'. (%s): %s\n", statement->name, db_vendor_name_map(db->vendor), PQresultErrorMessage(res));
+
+		PQclear(res);
+		if(!ok) return false;
+
+		db_statement_describe_postgres(statement, pgconn->conn);
+		pgconn->prepared++;
+	}
+
+	return true;
+}
+
+static void db_async_run_postgres(db_t *db, db_conn_postgres_t *pgconn, db_queue_postgres_t *batch);
+
+static __thread size_t db_pool_hint_postgres = SIZE_MAX;							// connection this thread used last, keeps threads apart
+static size_t db_pool_threads_postgres = 0;
+
+// claim any free connection without locking, starting from the one this thread used last. NULL if all are taken
+static db_conn_postgres_t *db_pool_claim_postgres(db_t *db){
+	if(__atomic_load_n(&db->context.available_connection, __ATOMIC_SEQ_CST) == 0) return NULL;
+
+	db_conn_postgres_t **connections = db->context.connections;
+	size_t count = db->context.connections_count;
+
+	if(db_pool_hint_postgres == SIZE_MAX)											// spread threads over the pool on first use
+		db_pool_hint_postgres = fio_atomic_add(&db_pool_threads_postgres, 1) - 1;
+
+	for(size_t k = 0; k < count; k++){
+		size_t i = (db_pool_hint_postgres + k) % count;
+
+		if(fio_trylock(&connections[i]->taken) == 0){
+			fio_atomic_sub(&db->context.available_connection, 1);
+			connections[i]->last_used = db_now_postgres();
+			db_pool_hint_postgres = i;
+			return connections[i];
+		}
+	}
+
+	return NULL;
+}
+
+// put a connection back on the free list
+static inline void db_pool_free_postgres(db_t *db, db_conn_postgres_t *pgconn){
+	fio_atomic_add(&db->context.available_connection, 1);
+	fio_unlock(&pgconn->taken);
+}
+
+// anyone waiting for a connection
+static inline bool db_pool_wanted_postgres(db_pool_postgres_t *pool){
+	return __atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST) > 0 || __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) > 0;
+}
+
+// swap the cancel handle for the one of the session of conn, NULL drops it. Every connect and reset starts a new session
+static void db_conn_cancel_set_postgres(db_conn_postgres_t *pgconn, PGconn *conn){
+	PGcancel *cancel = conn != NULL ? PQgetCancel(conn) : NULL;
+
+	fio_lock(&pgconn->cancel_lock);
+	PGcancel *old = pgconn->cancel;
+	pgconn->cancel = cancel;
+	fio_unlock(&pgconn->cancel_lock);
+
+	if(old != NULL)
+		PQfreeCancel(old);
+}
+
+static void db_async_deliver_postgres(db_queue_postgres_t *finished);
+
+// send a cancel for whatever the server is running on a connection. The server fails it with 57014
+static void db_conn_cancel_postgres(db_conn_postgres_t *pgconn){
+	char error[256];
+	fio_lock(&pgconn->cancel_lock);
+	if(pgconn->cancel != NULL)
+		PQcancel(pgconn->cancel, error, sizeof(error));
+	fio_unlock(&pgconn->cancel_lock);
+}
+
+// time out the queries of a connection past their deadline. A cancel hits whatever the server runs at that moment, so it is only sent when
+// the expired query is alone on the connection, a single cancel per deadline. Pipelined ones are abandoned instead: the caller gets the
+// timeout now and the results are dropped once they arrive, the queries behind them are never cancelled by mistake
+static void db_conn_expire_postgres(db_conn_postgres_t *pgconn, size_t now){
+	size_t deadline = __atomic_load_n(&pgconn->deadline, __ATOMIC_SEQ_CST);
+	bool pipelined = __atomic_load_n(&pgconn->inflight.count, __ATOMIC_SEQ_CST) > 0;
+	bool expired_now = deadline != 0 && now >= deadline && pgconn->cancelled != deadline;
+
+	if(!pipelined){																	// a blocking query, alone by definition
+		if(expired_now){
+			pgconn->cancelled = deadline;
+			db_conn_cancel_postgres(pgconn);
+		}
+		return;
+	}
+
+	if(fio_trylock(&pgconn->lock))													// on_data reading the pipeline, the next check finds it unlocked
+		return;
+
+	db_queue_postgres_t expired = {0};
+
+	if(pgconn->inflight.count == 1){
+		if(expired_now && pgconn->inflight.first->deadline == deadline){			// still the same query, nothing can be sent behind it while locked
+			pgconn->cancelled = deadline;
+			db_conn_cancel_postgres(pgconn);
+		}
+	}
+	else{
+		for(db_request_postgres_t *request = pgconn->inflight.first; request != NULL; request = request->next){
+			if(request->abandoned || request->deadline == 0 || now < request->deadline)
+				continue;
+
+			db_request_postgres_t *timeout = calloc(1, sizeof(db_request_postgres_t));	// stands in for the caller, the request stays in the pipeline
+			timeout->callback = request->callback;
+			timeout->udata = request->udata;
+			timeout->metric = request->metric;
+			timeout->started = request->started;
+			timeout->results = db_results_new(0, 0, db_error_code_timeout, "Query timed out");
+
+			request->abandoned = true;
+			db_queue_push_postgres(&expired, timeout);
+		}
+	}
+
+	fio_unlock(&pgconn->lock);
+	if(pgconn->uuid != -1)
+		fio_force_event(pgconn->uuid, FIO_EVENT_ON_DATA);							// data that arrived while locked would be missed otherwise
+
+	db_async_deliver_postgres(&expired);
+}
+
+// detach the reactor from a connection about to lose its socket. Connection lock must be held
+static void db_conn_detach_postgres(db_conn_postgres_t *pgconn){
+	if(pgconn->uuid != -1)
+		fio_close(pgconn->uuid);													// only the dup is closed, on_close ignores the old uuid
+
+	pgconn->uuid = -1;
+	pgconn->prepared = 0;															// statements die with the server session
+}
+
+// start reconnecting a broken connection owned by the caller. It stays off the free list until the maintenance sees it ready
+static void db_conn_reset_postgres(db_t *db, db_conn_postgres_t *pgconn){
+	fio_lock(&pgconn->lock);
+	db_conn_detach_postgres(pgconn);
+	pgconn->slot = db_slot_resetting_postgres;
+	pgconn->deadline = 0;
+	PQresetStart(pgconn->conn);														// on failure the maintenance starts it again
+	fio_unlock(&pgconn->lock);
+
+	db_conn_cancel_set_postgres(pgconn, NULL);
+	(void)db;
+}
+
+// close a connection owned by the caller, the slot stays held until opened again
+static void db_conn_close_postgres(db_t *db, db_conn_postgres_t *pgconn){
+	fio_lock(&pgconn->lock);
+	db_conn_detach_postgres(pgconn);
+	PQfinish(pgconn->conn);
+	pgconn->conn = NULL;
+	pgconn->slot = db_slot_closed_postgres;
+	pgconn->deadline = 0;
+	fio_unlock(&pgconn->lock);
+
+	db_conn_cancel_set_postgres(pgconn, NULL);
+
+	fio_atomic_sub(&db->context.connections_open, 1);
+}
+
+// connection done with its work. Goes to the oldest blocked caller, else takes the queued async requests into batch, else back to the free list. Empty batch means the caller no longer owns the connection
+static void db_pool_release_postgres(db_t *db, db_conn_postgres_t *pgconn, db_queue_postgres_t *batch){
+	db_pool_postgres_t *pool = db->context.pool;
+
+	while(pgconn != NULL){
+		if(PQstatus(pgconn->conn) == CONNECTION_BAD){								// broken, the pool maintenance takes it from here
+			db_conn_reset_postgres(db, pgconn);
+			return;
+		}
+
+		if(db_pool_wanted_postgres(pool)){
+			pthread_mutex_lock(&(db->context.connections_lock));
+
+			db_waiter_postgres_t *waiter = pool->waiters_first;
+			if(waiter != NULL){														// hand over, first come first served
+				pool->waiters_first = waiter->next;
+				if(pool->waiters_first == NULL)
+					pool->waiters_last = NULL;
+
+				fio_atomic_sub(&pool->waiting, 1);
+				waiter->conn = pgconn;
+				pthread_cond_signal(&waiter->cond);
+				pthread_mutex_unlock(&(db->context.connections_lock));
+				return;
+			}
+
+			size_t taken = batch->count;
+			db_queue_take_postgres(batch, &pool->pending, DB_PIPELINE_MAX_BATCH);
+			fio_atomic_sub(&pool->queued, batch->count - taken);
+			pthread_mutex_unlock(&(db->context.connections_lock));
+
+			if(batch->first != NULL)
+				return;
+		}
+
+		db_pool_free_postgres(db, pgconn);
+
+		if(!db_pool_wanted_postgres(pool))											// someone may have queued before seeing it free
+			return;
+
+		pgconn = db_pool_claim_postgres(db);
+	}
+}
+
+// block until a connection is handed over or DB_CONN_POOL_TIMEOUT passes. NULL on timeout
+static db_conn_postgres_t *db_pool_wait_postgres(db_t *db){
+	db_pool_postgres_t *pool = db->context.pool;
+	db_waiter_postgres_t waiter = {0};
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += DB_CONN_POOL_TIMEOUT / 1000;
+	deadline.tv_nsec += (DB_CONN_POOL_TIMEOUT % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L){
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_cond_init(&waiter.cond, NULL);
 
 	pthread_mutex_lock(&(db->context.connections_lock));
-	
-	PGconn **conns = db->context.connections;
-	PGconn *available_connection = conns[db->context.available_connection];
-	db->context.available_connection++;
+	if(pool->waiters_last != NULL)
+		pool->waiters_last->next = &waiter;
+	else
+		pool->waiters_first = &waiter;
 
+	pool->waiters_last = &waiter;
+	fio_atomic_add(&pool->waiting, 1);
 	pthread_mutex_unlock(&(db->context.connections_lock));
 
-	return available_connection;
-}
+	db_conn_postgres_t *claimed = db_pool_claim_postgres(db);						// freed before we were in the queue
 
-// return used connection
-static inline void db_return_conn_postgres(db_t *db, PGconn *conn){
-	if(db->context.available_connection == 0) return;
-	
-	PGconn **conns = db->context.connections;
-	
 	pthread_mutex_lock(&(db->context.connections_lock));
+	while(waiter.conn == NULL && claimed == NULL){
+		if(pthread_cond_timedwait(&waiter.cond, &(db->context.connections_lock), &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	if(waiter.conn == NULL){														// still queued, leave
+		db_waiter_postgres_t **link = &pool->waiters_first;
+		db_waiter_postgres_t *prev = NULL;
+
+		while(*link != &waiter){
+			prev = *link;
+			link = &(*link)->next;
+		}
 
-	db->context.available_connection--;
-	conns[db->context.available_connection] = conn; 
+		*link = waiter.next;
+		if(pool->waiters_last == &waiter)
+			pool->waiters_last = prev;
 
+		fio_atomic_sub(&pool->waiting, 1);
+	}
 	pthread_mutex_unlock(&(db->context.connections_lock));
+	pthread_cond_destroy(&waiter.cond);
+
+	if(waiter.conn == NULL)
+		return claimed;
+
+	if(claimed != NULL){															// got two, give one back
+		db_queue_postgres_t batch = {0};
+		db_pool_release_postgres(db, claimed, &batch);
+
+		if(batch.first != NULL)
+			db_async_run_postgres(db, claimed, &batch);
+	}
+
+	return waiter.conn;
 }
 
-// stat connection
-static db_state_t db_stat_function_postgres(db_t *db){
-	PGconn **connections = db->context.connections;
+// try and get a connection, blocks while the pool is exhausted
+static inline db_conn_postgres_t *db_request_conn_postgres(db_t *db){
+	if(db->state != db_state_connected) return NULL;
 
-	if(connections != NULL){
+	db_conn_postgres_t *pgconn = db_pool_claim_postgres(db);
+	if(pgconn != NULL) return pgconn;
+
+	return db_pool_wait_postgres(db);
+}
 
-		bool all_ok = true;
+// return used connection, queued async requests go out through it
+static inline void db_return_conn_postgres(db_t *db, db_conn_postgres_t *conn){
+	db_queue_postgres_t batch = {0};
+	db_pool_release_postgres(db, conn, &batch);
 
-		for(size_t i = 0; i < db->context.connections_count; i++){
-			if(connections[i] == NULL)												// any null cionnection is game over
-				return db_state_invalid_db;
+	if(batch.first != NULL)
+		db_async_run_postgres(db, conn, &batch);
+}
+
+static void db_pool_arm_postgres(db_pool_postgres_t *pool);
+
+// connection opened or reset, back to the free list through whoever is waiting for it
+static void db_conn_ready_postgres(db_t *db, db_conn_postgres_t *pgconn){
+	db_conn_cancel_set_postgres(pgconn, pgconn->conn);
+	pgconn->slot = db_slot_ready_postgres;
+	pgconn->last_used = db_now_postgres();
+	db_return_conn_postgres(db, pgconn);
+}
 
-			switch(PQconnectPoll(connections[i])){
-				case PGRES_POLLING_FAILED:											// if bad return failed
+// advance a connection being opened, once its socket is ready or on every maintenance run
+static void db_conn_poll_postgres(db_t *db, db_conn_postgres_t *pgconn){
+	db_pool_postgres_t *pool = db->context.pool;
+	pgconn->polling = PQconnectPoll(pgconn->conn);
+
+	switch(pgconn->polling){
+		case PGRES_POLLING_OK:
+			if(!pool->checked){														// the first connection up checks every statement, the others prepare them on first use
+				fio_lock(&pgconn->lock);
+				bool prepared = db_prepare_conn_postgres(db, pgconn);
+				fio_unlock(&pgconn->lock);
+
+				if(!prepared){
+					db_conn_close_postgres(db, pgconn);
 					db->state = db_state_failed_connection;
-					return db_state_failed_connection;
 					break;
+				}
 
-				case PGRES_POLLING_OK:												// when ok just continue to verify others
-					break;
+				pool->checked = true;
+			}
 
-				default:															// if any state other than ok or bad, then current status remain
-					all_ok = false;
-					break;
+			db_conn_ready_postgres(db, pgconn);
+			break;
+
+		case PGRES_POLLING_FAILED:
+			db_conn_close_postgres(db, pgconn);
+			break;
+
+		default:
+			break;
+	}
+}
+
+// bring the pool up polling every connecting socket at once. Connected once ready connections are up, the others keep coming up from the pool maintenance. Failed when every one failed, the state stays connecting on timeout
+static db_state_t db_wait_function_postgres(db_t *db, size_t ready, size_t timeout){
+	db_conn_postgres_t **connections = db->context.connections;
+
+	if(connections == NULL)
+		return db_state_invalid_db;													// no connections = game over
+
+	if(db->state != db_state_connecting)
+		return db->state;
+
+	if(ready > db->context.connections_min) ready = db->context.connections_min;
+	if(ready == 0) ready = 1;
+
+	size_t count = db->context.connections_count;
+	struct pollfd fds[count];
+	db_conn_postgres_t *polled[count];
+	uint64_t deadline = db_metrics_now() / 1000 + timeout;
+	bool waited = false;
+
+	while(true){
+		size_t up = 0;
+		size_t n = 0;
+
+		for(size_t i = 0; i < count; i++){
+			db_conn_postgres_t *pgconn = connections[i];
+
+			if(pgconn->slot == db_slot_ready_postgres){
+				up++;
+			}
+			else if(pgconn->slot == db_slot_connecting_postgres){
+				fds[n] = (struct pollfd){
+					.fd = PQsocket(pgconn->conn),
+					.events = pgconn->polling == PGRES_POLLING_READING ? POLLIN : POLLOUT,
+					.revents = 0
+				};
+				polled[n++] = pgconn;
 			}
 		}
 
-		if(all_ok){
-			db->state = db_state_connected;											// every connection was ok, then connected
+		if(up >= ready){
+			db->state = db_state_connected;
+			db_pool_arm_postgres(db->context.pool);									// the rest come up in the background
 			return db_state_connected;
 		}
-		else{
-			return db->state;														// if any other postgres state then return current db state
+
+		if(up == 0 && n == 0){
+			db->state = db_state_failed_connection;
+			return db_state_failed_connection;
 		}
+
+		uint64_t now = db_metrics_now() / 1000;
+		if(waited && now >= deadline)
+			return db->state;
+
+		poll(fds, n, now < deadline ? (int)(deadline - now) : 0);
+		waited = true;
+
+		for(size_t k = 0; k < n; k++){
+			if(fds[k].revents != 0)
+				db_conn_poll_postgres(db, polled[k]);
+		}
+
+		if(db->state == db_state_failed_connection)									// statements rejected
+			return db_state_failed_connection;
 	}
-	else{
-		return db_state_invalid_db;													// no connections = game over
+}
+
+// stat function, a single non blocking pass. Connected once every minimum connection is up
+static db_state_t db_stat_function_postgres(db_t *db){
+	return db_wait_function_postgres(db, db->context.connections_min, 0);
+}
+
+// fail async requests that waited for a connection past their deadline
+static void db_pool_expire_postgres(db_t *db, size_t now){
+	db_pool_postgres_t *pool = db->context.pool;
+	if(__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	db_queue_postgres_t expired = {0};
+	db_queue_postgres_t kept = {0};
+	db_request_postgres_t *request;
+
+	pthread_mutex_lock(&(db->context.connections_lock));
+	while((request = db_queue_pop_postgres(&pool->pending)) != NULL){
+		if(request->deadline != 0 && now >= request->deadline)
+			db_queue_push_postgres(&expired, request);
+		else
+			db_queue_push_postgres(&kept, request);
+	}
+
+	pool->pending = kept;
+	fio_atomic_sub(&pool->queued, expired.count);
+	pthread_mutex_unlock(&(db->context.connections_lock));
+
+	for(request = expired.first; request != NULL; request = request->next)
+		request->results = db_results_new(0, 0, db_error_code_timeout, "Query timed out waiting for a connection");
+
+	db_async_deliver_postgres(&expired);
+}
+
+// pool maintenance: probes idle connections, cancels queries past their deadline, finishes resets and new connections, grows while requests queue and shrinks when idle
+static void db_pool_maintain_postgres(db_t *db){
+	db_pool_postgres_t *pool = db->context.pool;
+	db_conn_postgres_t **connections = db->context.connections;
+	size_t now = db_now_postgres();
+	bool grow = db_pool_wanted_postgres(pool) && __atomic_load_n(&db->context.available_connection, __ATOMIC_SEQ_CST) == 0;
+
+	for(size_t i = 0; i < db->context.connections_count; i++){
+		db_conn_postgres_t *pgconn = connections[i];
+
+		switch(pgconn->slot){
+			case db_slot_ready_postgres:
+			{
+				if(fio_trylock(&pgconn->taken)){									// in use, it is checked when released
+					db_conn_expire_postgres(pgconn, now);
+					break;
+				}
+
+				fio_atomic_sub(&db->context.available_connection, 1);
+
+				fio_lock(&pgconn->lock);
+				bool alive = PQconsumeInput(pgconn->conn) && PQstatus(pgconn->conn) == CONNECTION_OK;	// reads EOF when the server went away
+				fio_unlock(&pgconn->lock);
+
+				if(!alive)
+					db_conn_reset_postgres(db, pgconn);
+				else if(db->context.connections_open > db->context.connections_min && now - pgconn->last_used >= DB_POOL_IDLE_TIMEOUT)
+					db_conn_close_postgres(db, pgconn);
+				else if(db_pool_wanted_postgres(pool))
+					db_return_conn_postgres(db, pgconn);
+				else
+					db_pool_free_postgres(db, pgconn);
+			}
+			break;
+
+			case db_slot_connecting_postgres:
+				db_conn_poll_postgres(db, pgconn);
+				break;
+
+			case db_slot_resetting_postgres:
+				switch(PQresetPoll(pgconn->conn)){
+					case PGRES_POLLING_OK:
+						db_conn_ready_postgres(db, pgconn);
+						break;
+
+					case PGRES_POLLING_FAILED:										// server still away, try again next run
+						PQresetStart(pgconn->conn);
+						break;
+
+					default:
+						break;
+				}
+				break;
+
+			case db_slot_closed_postgres:
+				if(
+					db->context.connections_open < db->context.connections_min ||
+					(grow && db->context.connections_open < db->context.connections_count)
+				){
+					pgconn->conn = db_conn_open_postgres(db, false);
+					if(pgconn->conn == NULL)
+						break;
+
+					pgconn->slot = db_slot_connecting_postgres;
+					pgconn->polling = PGRES_POLLING_WRITING;
+					fio_atomic_add(&db->context.connections_open, 1);
+					grow = false;													// one new connection per run
+				}
+				break;
+		}
+	}
+
+	db_pool_expire_postgres(db, now);
+}
+
+// drop a reference to the pool, the last one frees it
+static void db_pool_unref_postgres(db_pool_postgres_t *pool){
+	if(fio_atomic_sub(&pool->refs, 1) == 0)
+		free(pool);
+}
+
+// maintenance timer, rearms itself until the db is destroyed
+static void db_pool_tick_postgres(void *udata){
+	db_pool_postgres_t *pool = udata;
+
+	if(pool->stopped){
+		db_pool_unref_postgres(pool);
+		return;
+	}
+
+	if(fio_trylock(&pool->maintenance) == 0){
+		db_pool_maintain_postgres(pool->db);
+		fio_unlock(&pool->maintenance);
+	}
+
+	fio_run_every(DB_POOL_CHECK_INTERVAL, 1, db_pool_tick_postgres, pool, NULL);
+}
+
+// start the maintenance timer
+static void db_pool_arm_postgres(db_pool_postgres_t *pool){
+	if(pool->armed) return;
+
+	pool->armed = true;
+	fio_atomic_add(&pool->refs, 1);
+	fio_run_every(DB_POOL_CHECK_INTERVAL, 1, db_pool_tick_postgres, pool, NULL);
+}
+
+// deadline of an async query passed, check it now instead of on the next maintenance run
+static void db_pool_deadline_postgres(void *udata){
+	db_pool_postgres_t *pool = udata;
+	if(pool->stopped || fio_trylock(&pool->maintenance))							// a running maintenance checks the deadlines itself
+		return;
+
+	db_t *db = pool->db;
+	db_conn_postgres_t **connections = db->context.connections;
+	size_t now = db_now_postgres();
+
+	for(size_t i = 0; i < db->context.connections_count; i++){
+		if(connections[i]->slot == db_slot_ready_postgres)
+			db_conn_expire_postgres(connections[i], now);
 	}
+
+	db_pool_expire_postgres(db, now);
+	fio_unlock(&pool->maintenance);
+}
+
+// deadline timer done or dropped by the reactor
+static void db_pool_deadline_done_postgres(void *udata){
+	db_pool_unref_postgres(udata);
+}
+
+// check the deadline of an async query right when it passes
+static void db_pool_deadline_arm_postgres(db_pool_postgres_t *pool, size_t timeout){
+	fio_atomic_add(&pool->refs, 1);													// on_finish runs even when the timer could not be set
+	fio_run_every(timeout + 1, 1, db_pool_deadline_postgres, pool, db_pool_deadline_done_postgres);
+}
+
+// free async request
+static void db_request_destroy_postgres(db_request_postgres_t *request){
+	free(request->params);
+	free(request->query);
+	free(request);
 }
 
 // close db connection
 static void db_destroy_function_postgres(db_t *db){
-	PGconn **connections = db->context.connections;
+	db_conn_postgres_t **connections = db->context.connections;
 
 	if(connections != NULL){
 		for(size_t i = 0; i < db->context.connections_count; i++){
-			if(connections[i] != NULL)
-				PQfinish(connections[i]);
+			if(connections[i] != NULL){
+				if(connections[i]->conn != NULL)
+					PQfinish(connections[i]->conn);
+
+				if(connections[i]->cancel != NULL)
+					PQfreeCancel(connections[i]->cancel);
+
+				free(connections[i]);
+			}
 		}
 	}
 
+	db_pool_postgres_t *pool = db->context.pool;
+	if(pool != NULL){																// requests that never got a connection
+		db_request_postgres_t *request;
+		while((request = db_queue_pop_postgres(&pool->pending)) != NULL)
+			db_request_destroy_postgres(request);
+
+		pool->stopped = true;														// timers still holding it free it on their next run
+		db_pool_unref_postgres(pool);
+	}
+
+	for(size_t i = 0; i < db->statements_count; i++)
+		free(db->statements[i].context);
+
 	free(db->context.connections);
 }
 
@@ -626,312 +1360,1391 @@ static db_type_t db_type_map_postgres(Oid oid){
 	return db_type_invalid;
 }
 
-// process entries
-static void db_process_entries_postgres(db_results_t *results, PGresult *res){
-	results->entries_count = PQntuples(res);
-	results->fields_count = PQnfields(res);
-	db_type_t types[results->fields_count];
+// ------------------------------------------------------------ Postgres binary format ---------------------------------------------
+
+// statement info learned from the server the first time it is prepared
+typedef struct{
+	int params_count;
+	Oid *param_types;
+	bool binary_results;															// every result column can be decoded from the binary format
+}db_statement_postgres_t;
+
+// query params ready to be sent. Arrays and values live in the same allocation
+typedef struct db_params_postgres_t{
+	int count;
+	char **values;
+	int *lengths;
+	int *formats;
+	Oid *types;
+}db_params_postgres_t;
+
+// network byte order writes
+static inline void db_put_be16_postgres(char *dst, uint16_t value){
+	dst[0] = (char)(value >> 8);
+	dst[1] = (char)(value);
+}
 
-	results->entries = malloc(sizeof(db_entry_t) * results->entries_count);
-	results->fields = malloc(sizeof(db_entry_t) * results->fields_count);
+static inline void db_put_be32_postgres(char *dst, uint32_t value){
+	dst[0] = (char)(value >> 24);
+	dst[1] = (char)(value >> 16);
+	dst[2] = (char)(value >> 8);
+	dst[3] = (char)(value);
+}
 
-	// fields names and types
-	for(size_t j = 0; j < results->fields_count; j++){
-		results->fields[j] = strdup(PQfname(res, j));
-		types[j] = db_type_map_postgres(PQftype(res, j));
-	}
+static inline void db_put_be64_postgres(char *dst, uint64_t value){
+	db_put_be32_postgres(dst, (uint32_t)(value >> 32));
+	db_put_be32_postgres(dst + 4, (uint32_t)value);
+}
 
-	// result values
-	for(size_t i = 0; i < results->entries_count; i++){
-		results->entries[i] = malloc(sizeof(db_entry_t) * results->fields_count);
+// network byte order reads
+static inline uint16_t db_get_be16_postgres(const char *src){
+	const uint8_t *b = (const uint8_t*)src;
+	return (uint16_t)((b[0] << 8) | b[1]);
+}
 
-		// for every columns/field
-		for(size_t j = 0; j < results->fields_count; j++){
-			db_entry_t entry = {
-				.value = NULL,
-				.count = 0,
-				.size = 0,
-				.type = types[j]
-			};
+static inline uint32_t db_get_be32_postgres(const char *src){
+	const uint8_t *b = (const uint8_t*)src;
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+}
 
-			if(PQgetisnull(res, i, j)){												// if null value
-				entry.type = db_type_null;
-				results->entries[i][j] = entry;
-				continue;
+static inline uint64_t db_get_be64_postgres(const char *src){
+	return ((uint64_t)db_get_be32_postgres(src) << 32) | (uint64_t)db_get_be32_postgres(src + 4);
+}
+
+// types that have a binary decoder
+static bool db_binary_supported_postgres(Oid oid){
+	switch(oid){
+		case oid_bool:
+		case oid_int2:
+		case oid_int4:
+		case oid_int8:
+		case oid_oid:
+		case oid_float4:
+		case oid_float8:
+		case oid_text:
+		case oid_varchar:
+		case oid_bpchar:
+		case oid_name:
+		case oid_json:
+		case oid_uuid:
+		case oid__int2:
+		case oid__int4:
+		case oid__int8:
+		case oid__text:
+		case oid__varchar:
+		case oid__bpchar:
+		case oid__name:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+// array type for an element type
+static Oid db_array_oid_postgres(Oid elem){
+	switch(elem){
+		case oid_bool:		return oid__bool;
+		case oid_int2:		return oid__int2;
+		case oid_int8:		return oid__int8;
+		case oid_float4:	return oid__float4;
+		case oid_float8:	return oid__float8;
+		case oid_varchar:	return oid__varchar;
+		case oid_bpchar:	return oid__bpchar;
+		case oid_text:		return oid__text;
+		default:
+		case oid_int4:		return oid__int4;
+	}
+}
+
+// element type for an array type. 0 if not a known array
+static Oid db_array_elem_oid_postgres(Oid array){
+	switch(array){
+		case oid__bool:		return oid_bool;
+		case oid__int2:		return oid_int2;
+		case oid__int4:		return oid_int4;
+		case oid__int8:		return oid_int8;
+		case oid__float4:	return oid_float4;
+		case oid__float8:	return oid_float8;
+		case oid__varchar:	return oid_varchar;
+		case oid__bpchar:	return oid_bpchar;
+		case oid__text:		return oid_text;
+		case oid__name:		return oid_name;
+		default:			return 0;
+	}
+}
+
+// default wire type for a param type when the server didn't tell which one it expects
+static Oid db_default_oid_postgres(db_type_t type){
+	switch(type){
+		case db_type_bool:			return oid_bool;
+		case db_type_float:			return oid_float4;
+		case db_type_string:		return oid_text;
+		default:
+		case db_type_integer:		return oid_int4;
+	}
+}
+
+// learn param and result types of a prepared statement, only done once per statement
+static void db_statement_describe_postgres(db_statement_t *statement, PGconn *conn){
+	if(statement->context != NULL) return;
+
+	PGresult *res = PQdescribePrepared(conn, statement->name);
+	if(PQresultStatus(res) != PGRES_COMMAND_OK){
+		PQclear(res);
+		return;
+	}
+
+	int params_count = PQnparams(res);
+	db_statement_postgres_t *described = malloc(sizeof(db_statement_postgres_t) + sizeof(Oid) * params_count);
+	described->params_count = params_count;
+	described->param_types = (Oid*)(described + 1);
+	described->binary_results = true;
+
+	for(int i = 0; i < params_count; i++)
+		described->param_types[i] = PQparamtype(res, i);
+
+	for(int j = 0; j < PQnfields(res); j++){
+		if(!db_binary_supported_postgres(PQftype(res, j)))
+			described->binary_results = false;
+	}
+
+	PQclear(res);
+
+	if(!__sync_bool_compare_and_swap(&(statement->context), NULL, described))		// another connection described it first
+		free(described);
+}
+
+// element type of an array param
+static db_type_t db_param_elem_type_postgres(db_type_t type){
+	switch(type){
+		case db_type_integer_array:	return db_type_integer;
+		case db_type_bool_array:	return db_type_bool;
+		case db_type_float_array:	return db_type_float;
+		case db_type_string_array:	return db_type_string;
+		default:					return db_type_invalid;
+	}
+}
+
+// value of the k-th element of an array param, or of a simple param
+static inline void *db_param_value_postgres(db_param_t *param, size_t k){
+	if(!param->is_array) return param->value;
+	return ((void**)param->value)[k];
+}
+
+// worst case encoded size of a single value
+static size_t db_value_size_postgres(db_type_t type, void *value, db_format_t format, bool quoted){
+	switch(type){
+		case db_type_integer:	return format == db_format_binary ? 8 : 12;
+		case db_type_bool:		return format == db_format_binary ? 1 : 6;
+		case db_type_float:		return format == db_format_binary ? 8 : 50;
+		case db_type_string:	return quoted ? strlen((char*)value) * 2 + 2 : strlen((char*)value);
+		default:				return 0;
+	}
+}
+
+// write a single value as text. Returns written size
+static int db_encode_text_postgres(char *dst, db_type_t type, void *value, bool quoted){
+	switch(type){
+		case db_type_integer:
+			return sprintf(dst, "%d", *((int*)value));
+
+		case db_type_bool:
+			return sprintf(dst, "%s", *((bool*)value) ? "true" : "false");
+
+		case db_type_float:
+			return sprintf(dst, "%f", *((float*)value));
+
+		case db_type_string:
+		{
+			char *src = (char*)value;
+			char *cursor = dst;
+
+			if(!quoted){
+				size_t len = strlen(src);
+				memcpy(dst, src, len);
+				return (int)len;
+			}
+
+			*cursor++ = '"';														// array elements are quoted so commas and braces survive
+			for(; *src != '\0'; src++){
+				if(*src == '"' || *src == '\\')
+					*cursor++ = '\\';
+
+				*cursor++ = *src;
 			}
+			*cursor++ = '"';
+
+			return (int)(cursor - dst);
+		}
+
+		default:
+			return 0;
+	}
+}
+
+// write a single value in binary for the wire type. Returns written size
+static int db_encode_binary_postgres(char *dst, db_type_t type, void *value, Oid oid){
+	switch(type){
+		case db_type_integer:
+			switch(oid){
+				case oid_int8:
+					db_put_be64_postgres(dst, (uint64_t)(int64_t)*((int*)value));
+					return 8;
+
+				case oid_int2:
+					db_put_be16_postgres(dst, (uint16_t)(int16_t)*((int*)value));
+					return 2;
 
-			switch(types[j]){
-				// unexpected values
 				default:
-				case db_type_null:
-				case db_type_invalid:
-					break;
+					db_put_be32_postgres(dst, (uint32_t)*((int*)value));
+					return 4;
+			}
 
-				case db_type_bool:
-					entry.size = sizeof(bool);
-					entry.value = malloc(entry.size);
-					*((bool*)entry.value) = (bool)strcmp(PQgetvalue(res, i, j), "false");
-					break;
+		case db_type_bool:
+			*dst = *((bool*)value) ? 1 : 0;
+			return 1;
+
+		case db_type_float:
+			if(oid == oid_float8){
+				double number = *((float*)value);
+				uint64_t bits;
+				memcpy(&bits, &number, sizeof(bits));
+				db_put_be64_postgres(dst, bits);
+				return 8;
+			}
+			else{
+				float number = *((float*)value);
+				uint32_t bits;
+				memcpy(&bits, &number, sizeof(bits));
+				db_put_be32_postgres(dst, bits);
+				return 4;
+			}
 
-				case db_type_integer:
-					entry.size = sizeof(int);
-					entry.value = malloc(entry.size);
-					*((int*)entry.value) = (int)strtol(PQgetvalue(res, i, j), NULL, 10);
-					break;
+		case db_type_string:
+		{
+			size_t len = strlen((char*)value);
+			memcpy(dst, value, len);
+			return (int)len;
+		}
 
-				case db_type_float:
-					entry.size = sizeof(float);
-					entry.value = malloc(entry.size);
-					*((float*)entry.value) = (float)strtof(PQgetvalue(res, i, j), NULL);
-					break;
-					
-				case db_type_string:
-					entry.size = PQgetlength(res, i, j);
-					entry.value = strdup(PQgetvalue(res, i, j));
-					break;
+		default:
+			return 0;
+	}
+}
 
-				// case db_type_blob:
-				
-				case db_type_integer_array:
-				{
-					size_t elem = 0;
-					char *array = strdup(PQgetvalue(res, i, j));
-					char *cursor = array;
-					char *current_value;
-
-					// count values
-					while(cursor != NULL){
-						if(*cursor == ',' || *cursor == '{')
-							entry.count++;
-
-						cursor++;	
-					}
+// worst case encoded size of a param
+static size_t db_param_size_postgres(db_param_t *param, db_format_t format){
+	if(param->type == db_type_null || (!param->is_array && param->value == NULL))
+		return 1;
 
-					entry.size = sizeof(int);
-					entry.value = malloc(entry.size * entry.count);
-					cursor = array;
-					
-					// get values
-					while(cursor != NULL){
-						if(*cursor == '{'){
-							cursor++;
-							current_value = cursor;
-						}
-						else if(*cursor == '}'){
-							*cursor = '\0';
-							*((int**)entry.value)[elem] = (int)strtol(current_value, NULL, 10);
-							break;
-						}
-						else if(*cursor == ','){
-							*cursor = '\0';
-							*((int**)entry.value)[elem] = (int)strtol(current_value, NULL, 10);
-							elem++;
-							cursor++;
-						}
-						else{
-							cursor++;
-						}
-					}
-					
-					free(array);
-				}
-				break;
+	if(!param->is_array)
+		return db_value_size_postgres(param->type, param->value, format, false) + 1;
 
-				case db_type_string_array:
-				{
-					size_t elem = 0;
-					char *array = strdup(PQgetvalue(res, i, j));
-					char *cursor = array;
-					char *current_value;
+	db_type_t elem = db_param_elem_type_postgres(param->type);
+	size_t size = format == db_format_binary ? 20 : 3;								// binary array header | braces and terminator
 
-					// count values
-					while(*cursor != '\0'){
-						if(*cursor == ',' || *cursor == '{')
-							entry.count++;
+	for(size_t k = 0; param->value != NULL && k < param->count; k++)
+		size += db_value_size_postgres(elem, db_param_value_postgres(param, k), format, true) + 4;
 
-						cursor++;	
-					}
+	return size;
+}
 
-					entry.size = sizeof(char*);
-					entry.value = malloc(entry.size * entry.count);
-					cursor = array;
-					
-					// get values
-					while(*cursor != '\0'){
-						if(*cursor == '{'){
-							cursor++;
-							current_value = cursor;
-						}
-						else if(*cursor == '}'){
-							*cursor = '\0';
-							((char**)entry.value)[elem] = strdup(current_value);
-							break;
-						}
-						else if(*cursor == ','){
-							*cursor = '\0';
-							((char**)entry.value)[elem] = strdup(current_value);
-							elem++;
-							cursor++;
-							current_value = cursor;
-						}
-						else{
-							cursor++;
-						}
-					}
-					
-					free(array);
+// encode params for sending. targets are the types the server expects, NULL if unknown. NULL if any param is invalid
+static db_params_postgres_t *db_params_new_postgres(size_t params_count, db_param_t *params, db_format_t format, Oid *targets){
+	size_t size = 0;
+
+	for(size_t i = 0; i < params_count; i++){										// for each param
+		if(params[i].type == db_type_invalid)										// invalid type
+			return NULL;
+
+		size += db_param_size_postgres(&params[i], format);
+	}
+
+	size_t arrays = params_count * (sizeof(char*) + sizeof(int) * 2 + sizeof(Oid));
+	char *block = malloc(sizeof(db_params_postgres_t) + arrays + size);
+
+	db_params_postgres_t *encoded = (db_params_postgres_t*)block;
+	encoded->count = (int)params_count;
+	encoded->values = (char**)(block + sizeof(db_params_postgres_t));
+	encoded->lengths = (int*)(encoded->values + params_count);
+	encoded->formats = encoded->lengths + params_count;
+	encoded->types = (Oid*)(encoded->formats + params_count);
+
+	char *cursor = (char*)(encoded->types + params_count);
+
+	for(size_t i = 0; i < params_count; i++){
+		db_param_t *param = &params[i];
+		Oid target = targets != NULL ? targets[i] : 0;
+
+		encoded->values[i] = cursor;
+		encoded->lengths[i] = 0;
+		encoded->formats[i] = 0;
+		encoded->types[i] = target;
+
+		if(param->type == db_type_null || (!param->is_array && param->value == NULL)){	// sql null
+			encoded->values[i] = NULL;
+			continue;
+		}
+
+		if(param->is_array){														// for array type
+			db_type_t elem = db_param_elem_type_postgres(param->type);
+			size_t count = param->value != NULL ? param->count : 0;
+
+			if(format == db_format_binary){
+				Oid elem_oid = db_array_elem_oid_postgres(target);
+				if(elem_oid == 0)
+					elem_oid = db_default_oid_postgres(elem);
+
+				char *array = cursor;
+				db_put_be32_postgres(cursor, count > 0 ? 1 : 0);					// dimensions
+				db_put_be32_postgres(cursor + 4, 0);								// has nulls
+				db_put_be32_postgres(cursor + 8, elem_oid);
+				cursor += 12;
+
+				if(count > 0){
+					db_put_be32_postgres(cursor, (uint32_t)count);					// dimension size
+					db_put_be32_postgres(cursor + 4, 1);							// lower bound
+					cursor += 8;
 				}
-				break;
 
-				case db_type_bool_array:
-					break;
-				case db_type_float_array:
-					break;
-				case db_type_blob_array:
-					break;
+				for(size_t k = 0; k < count; k++){
+					int len = db_encode_binary_postgres(cursor + 4, elem, db_param_value_postgres(param, k), elem_oid);
+					db_put_be32_postgres(cursor, (uint32_t)len);
+					cursor += 4 + len;
+				}
+
+				encoded->lengths[i] = (int)(cursor - array);
+				encoded->formats[i] = 1;
+				encoded->types[i] = target != 0 ? target : db_array_oid_postgres(elem_oid);
+			}
+			else{
+				*cursor++ = '{';
+				for(size_t k = 0; k < count; k++){
+					if(k != 0)
+						*cursor++ = ',';
+
+					cursor += db_encode_text_postgres(cursor, elem, db_param_value_postgres(param, k), elem == db_type_string);
+				}
+				*cursor++ = '}';
+				*cursor++ = '\0';
 			}
+		}
+		else if(format == db_format_binary && param->type != db_type_string){		// strings go as text, it is the same bytes
+			Oid oid = target != 0 ? target : db_default_oid_postgres(param->type);
 
-			results->entries[i][j] = entry;
+			encoded->lengths[i] = db_encode_binary_postgres(cursor, param->type, param->value, oid);
+			encoded->formats[i] = 1;
+			encoded->types[i] = oid;
+			cursor += encoded->lengths[i];
+		}
+		else{																		// for simple type as text
+			int len = db_encode_text_postgres(cursor, param->type, param->value, false);
+			cursor[len] = '\0';
+			encoded->lengths[i] = len;
+			cursor += len + 1;
 		}
 	}
-}
 
-static db_results_t *db_exec_function_postgres(db_t *db, void *connection, char *query, size_t params_count, va_list params){
-	PGresult *res;
-	PGconn *conn = (PGconn*)connection;
+	return encoded;
+}
 
-	if(params_count == 0){															// no params
-		res = PQexec(conn, query);
+// integer value from a binary int type
+static int64_t db_get_integer_postgres(Oid oid, const char *value, int length){
+	switch(length){
+		case 2:		return (int16_t)db_get_be16_postgres(value);
+		case 8:		return (int64_t)db_get_be64_postgres(value);
+		default:	return oid == oid_oid ? (int64_t)db_get_be32_postgres(value) : (int32_t)db_get_be32_postgres(value);
 	}
-	else{																			// with params
-		char *query_params[params_count];
-		string *values[params_count];
+}
 
-		// process params 
-		for(size_t i = 0; i < params_count; i++){									// for each param
-			db_param_t param = va_arg(params, db_param_t);
-			values[i] = string_new();
+// format 16 uuid bytes as text
+static void db_uuid_format_postgres(const char *value, char *dst){
+	static const char hex[] = "0123456789abcdef";
+	const uint8_t *bytes = (const uint8_t*)value;
 
-			if(param.type == db_type_invalid){										// invalid type
-				return db_results_new(0, 0, db_error_code_invalid_type, "An input param for the query was invalid");
-			}
+	for(int k = 0; k < 16; k++){
+		if(k == 4 || k == 6 || k == 8 || k == 10)
+			*dst++ = '-';
 
-			if(param.is_array){														// for array type
-				string_cat_raw(values[i], "{");
-				
-				for(size_t j = 0; j < param.count; j++){
+		*dst++ = hex[bytes[k] >> 4];
+		*dst++ = hex[bytes[k] & 0x0f];
+	}
 
-					if(j != 0)
-						string_cat_raw(values[i], ",");
+	*dst = '\0';
+}
 
-					switch(param.type){
-						case db_type_integer_array:									// integer array
-							string_cat_fmt(values[i], "%d", 25, ((int**)param.value)[j]);
-						break;
+// arena copy of a binary string value
+static char *db_string_from_binary_postgres(db_results_t *results, Oid oid, const char *value, int length){
+	if(oid == oid_uuid && length == 16){
+		char *uuid = db_results_alloc(results, 37, 1);
+		db_uuid_format_postgres(value, uuid);
+		return uuid;
+	}
 
-						case db_type_bool_array:   									// bool array
-							string_cat_fmt(values[i], "%s", 6, ((bool**)param.value)[j] ? "true" : "false");
-						break;
+	char *str = db_results_alloc(results, length + 1, 1);
+	memcpy(str, value, length);
+	str[length] = '\0';
+	return str;
+}
 
-						case db_type_float_array:  									// float array
-							string_cat_fmt(values[i], "%f", 50, ((float**)param.value)[j]);
-						break;
+// decode a binary value into entry, type was already mapped from the oid
+static void db_entry_from_binary_postgres(db_results_t *results, db_entry_t *entry, Oid oid, const char *value, int length){
+	switch(entry->type){
+		case db_type_bool:
+			entry->size = sizeof(bool);
+			entry->value = db_results_alloc(results, entry->size, sizeof(bool));
+			*((bool*)entry->value) = value[0] != 0;
+			break;
+
+		case db_type_integer:
+			entry->size = sizeof(int);
+			entry->value = db_results_alloc(results, entry->size, sizeof(int));
+			*((int*)entry->value) = (int)db_get_integer_postgres(oid, value, length);
+			break;
+
+		case db_type_float:
+			entry->size = sizeof(float);
+			entry->value = db_results_alloc(results, entry->size, sizeof(float));
+
+			if(oid == oid_float8){
+				uint64_t bits = db_get_be64_postgres(value);
+				double number;
+				memcpy(&number, &bits, sizeof(number));
+				*((float*)entry->value) = (float)number;
+			}
+			else{
+				uint32_t bits = db_get_be32_postgres(value);
+				memcpy(entry->value, &bits, sizeof(float));
+			}
+			break;
+
+		case db_type_string:
+			entry->value = db_string_from_binary_postgres(results, oid, value, length);
+			entry->size = strlen(entry->value);
+			break;
+
+		case db_type_integer_array:
+		case db_type_string_array:
+		{
+			int dims = (int)db_get_be32_postgres(value);
+			Oid elem_oid = db_get_be32_postgres(value + 8);
+			const char *cursor = value + 12;
+
+			entry->count = dims > 0 ? 1 : 0;
+			for(int d = 0; d < dims; d++){											// nested arrays are flattened
+				entry->count *= db_get_be32_postgres(cursor);
+				cursor += 8;
+			}
 
-						case db_type_string_array: 									// string array
-							string_cat_fmt(values[i], "%s", strlen(((char**)param.value)[j]) + 1, ((char**)param.value)[j]);
-						break;
+			entry->size = entry->type == db_type_integer_array ? sizeof(int) : sizeof(char*);
+			entry->value = db_results_alloc(results, sizeof(void*) * entry->count, sizeof(void*));
+			int *numbers = entry->type == db_type_integer_array ? db_results_alloc(results, sizeof(int) * entry->count, sizeof(int)) : NULL;
 
-						// TODO add blob array type param
-						// case db_type_blob_array:   									// blob array
-						// break;
+			for(size_t k = 0; k < entry->count; k++){
+				int len = (int32_t)db_get_be32_postgres(cursor);
+				cursor += 4;
 
-						default:
-							break;
-					}
+				if(numbers != NULL){
+					numbers[k] = len < 0 ? 0 : (int)db_get_integer_postgres(elem_oid, cursor, len);
+					((int**)entry->value)[k] = &numbers[k];
+				}
+				else{
+					((char**)entry->value)[k] = db_string_from_binary_postgres(results, elem_oid, cursor, len < 0 ? 0 : len);
 				}
-				string_cat_raw(values[i], "}");
+
+				if(len > 0)
+					cursor += len;
 			}
-			else{																	// for simple type
-				switch(param.type){
-					case db_type_integer:											// integer
-						string_cat_fmt(values[i], "%d", 25, *((int*)param.value));
-					break;
+		}
+		break;
 
-					case db_type_bool:   											// bool
-						string_cat_fmt(values[i], "%s", 6, *((bool*)param.value) ? "true" : "false");
-					break;
+		default:
+			entry->type = db_type_invalid;
+			break;
+	}
+}
 
-					case db_type_float:  											// float
-						string_cat_fmt(values[i], "%f", 50, *((float*)param.value));
-					break;
+// decode a text array literal like {a,"b c",NULL} into entry. Elements are split in place on an arena copy
+static void db_entry_from_text_array_postgres(db_results_t *results, db_entry_t *entry, const char *value, int length){
+	char *array = db_results_alloc(results, length + 1, 1);
+	memcpy(array, value, length + 1);
+
+	// count values, commas inside quotes don't count
+	bool quoted = false;
+	entry->count = (length > 2) ? 1 : 0;											// "{}" is empty
+	for(char *cursor = array; *cursor != '\0'; cursor++){
+		if(*cursor == '\\' && quoted && cursor[1] != '\0')
+			cursor++;
+		else if(*cursor == '"')
+			quoted = !quoted;
+		else if(*cursor == ',' && !quoted)
+			entry->count++;
+	}
 
-					case db_type_string: 											// string
-						string_cat_fmt(values[i], "%s", strlen((char*)param.value) + 1, (char*)param.value);
-					break;
+	entry->value = db_results_alloc(results, sizeof(void*) * entry->count, sizeof(void*));
+	int *numbers = entry->type == db_type_integer_array ? db_results_alloc(results, sizeof(int) * entry->count, sizeof(int)) : NULL;
+	entry->size = numbers != NULL ? sizeof(int) : sizeof(char*);
 
-					// TODO add blob type param
-					case db_type_blob:												// blob
-					break;
+	// get values, unquoting in place
+	char *cursor = array + 1;
+	for(size_t elem = 0; elem < entry->count; elem++){
+		char *start = cursor;
+		char *write = cursor;
+		bool was_quoted = *cursor == '"';
 
-					default:
-					case db_type_invalid:
-					case db_type_null:   											// null
-						string_cat_fmt(values[i], "%s", 5, "null");
-					break;
-				}
+		if(was_quoted){
+			cursor++;
+			while(*cursor != '\0' && *cursor != '"'){
+				if(*cursor == '\\' && cursor[1] != '\0')
+					cursor++;
+
+				*write++ = *cursor++;
 			}
 
-			query_params[i] = values[i]->raw;
+			if(*cursor == '"')
+				cursor++;
 		}
+		else{
+			while(*cursor != '\0' && *cursor != ',' && *cursor != '}')
+				*write++ = *cursor++;
+		}
+
+		bool is_null = !was_quoted && (write - start) == 4 && strncmp(start, "NULL", 4) == 0;
+		cursor++;																	// skip ',' or '}'
+		*write = '\0';
 
-		res =																		// exec query 
-			PQexecParams(conn, query, params_count, NULL, (const char *const *)query_params, NULL, NULL, 0);
+		if(is_null)
+			*start = '\0';
 
-		for(size_t i = 0; i < params_count; i++){									// free values
-			string_destroy(values[i]);
+		if(numbers != NULL){
+			numbers[elem] = (int)strtol(start, NULL, 10);
+			((int**)entry->value)[elem] = &numbers[elem];
+		}
+		else{
+			((char**)entry->value)[elem] = start;
 		}
 	}
-	
+}
+
+// decode a text value into entry
+static void db_entry_from_text_postgres(db_results_t *results, db_entry_t *entry, const char *value, int length){
+	switch(entry->type){
+		// unexpected values
+		default:
+		case db_type_null:
+		case db_type_invalid:
+			break;
+
+		case db_type_bool:
+			entry->size = sizeof(bool);
+			entry->value = db_results_alloc(results, entry->size, sizeof(bool));
+			*((bool*)entry->value) = value[0] == 't';
+			break;
+
+		case db_type_integer:
+			entry->size = sizeof(int);
+			entry->value = db_results_alloc(results, entry->size, sizeof(int));
+			*((int*)entry->value) = (int)strtol(value, NULL, 10);
+			break;
+
+		case db_type_float:
+			entry->size = sizeof(float);
+			entry->value = db_results_alloc(results, entry->size, sizeof(float));
+			*((float*)entry->value) = (float)strtof(value, NULL);
+			break;
+			
+		case db_type_string:
+			entry->size = length;
+			entry->value = db_results_alloc(results, length + 1, 1);
+			memcpy(entry->value, value, length + 1);
+			break;
+
+		// case db_type_blob:
+		
+		case db_type_integer_array:
+		case db_type_string_array:
+			db_entry_from_text_array_postgres(results, entry, value, length);
+			break;
+
+		case db_type_bool_array:
+			break;
+		case db_type_float_array:
+			break;
+		case db_type_blob_array:
+			break;
+	}
+}
+
+// decode a single value. Borrowed strings point straight into the PGresult, libpq keeps every value null terminated
+static void db_entry_decode_value_postgres(db_results_t *results, db_entry_t *entry, Oid oid, int format, char *value, int length, bool borrow){
+	if(borrow && entry->type == db_type_string && !(format == 1 && oid == oid_uuid)){
+		entry->value = value;
+		entry->size = length;
+	}
+	else if(format == 1)
+		db_entry_from_binary_postgres(results, entry, oid, value, length);
+	else
+		db_entry_from_text_postgres(results, entry, value, length);
+}
+
+// decode a borrowed entry on first read
+static void db_entry_decode_postgres(db_results_t *results, db_entry_t *entry, uint32_t row, uint32_t field){
+	PGresult *res = results->borrowed;
+	db_entry_decode_value_postgres(results, entry, PQftype(res, field), PQfformat(res, field), PQgetvalue(res, row, field), PQgetlength(res, row, field), true);
+}
+
+// arena size for a result. Exact for the tables, a generous estimate for the values, overflow goes to extra chunks. Borrowed strings take no room
+static size_t db_results_size_postgres(PGresult *res, bool borrow){
+	size_t entries = PQntuples(res);
+	size_t fields = PQnfields(res);
+	size_t size = fields * sizeof(char*) + entries * (sizeof(db_entry_t*) + fields * sizeof(db_entry_t)) + 64;
+
+	for(size_t j = 0; j < fields; j++){
+		db_type_t type = db_type_map_postgres(PQftype(res, j));
+
+		if(!borrow)
+			size += strlen(PQfname(res, j)) + 1;
+		else if(type == db_type_string && !(PQfformat(res, j) == 1 && PQftype(res, j) == oid_uuid))
+			continue;
+
+		for(size_t i = 0; i < entries; i++)
+			size += PQgetlength(res, i, j) * 2 + 24;								// room for terminators, uuid text, array tables and alignment
+	}
+
+	return size;
+}
+
+// process entries. Borrowed entries only get their type, values are decoded by db_results_get_entry()
+static void db_process_entries_postgres(db_results_t *results, PGresult *res, bool borrow){
+	results->entries_count = PQntuples(res);
+	results->fields_count = PQnfields(res);
+	db_type_t types[results->fields_count];
+	Oid oids[results->fields_count];
+	int formats[results->fields_count];
+
+	results->entries = db_results_alloc(results, sizeof(db_entry_t*) * results->entries_count, sizeof(void*));
+	results->fields = db_results_alloc(results, sizeof(char*) * results->fields_count, sizeof(void*));
+
+	// fields names and types
+	for(size_t j = 0; j < results->fields_count; j++){
+		char *name = PQfname(res, j);
+
+		if(borrow){
+			results->fields[j] = name;
+		}
+		else{
+			size_t len = strlen(name);
+			results->fields[j] = db_results_alloc(results, len + 1, 1);
+			memcpy(results->fields[j], name, len + 1);
+		}
+
+		oids[j] = PQftype(res, j);
+		types[j] = db_type_map_postgres(oids[j]);
+		formats[j] = PQfformat(res, j);
+	}
+
+	// result values
+	for(size_t i = 0; i < results->entries_count; i++){
+		results->entries[i] = db_results_alloc(results, sizeof(db_entry_t) * results->fields_count, sizeof(void*));
+
+		// for every columns/field
+		for(size_t j = 0; j < results->fields_count; j++){
+			db_entry_t *entry = &(results->entries[i][j]);
+			*entry = (db_entry_t){
+				.value = NULL,
+				.count = 0,
+				.size = 0,
+				.type = types[j],
+				.pending = borrow
+			};
+
+			if(PQgetisnull(res, i, j)){												// if null value
+				entry->type = db_type_null;
+				entry->pending = false;
+				continue;
+			}
+
+			if(!borrow)
+				db_entry_decode_value_postgres(results, entry, oids[j], formats[j], PQgetvalue(res, i, j), PQgetlength(res, i, j), false);
+		}
+	}
+}
+
+// turn a postgres result into a results object. Takes res, it is cleared or kept by borrowed results
+static db_results_t *db_results_from_postgres(db_t *db, PGresult *res, PGconn *conn){
+	if(res != NULL && db_error_code_map(db->vendor, PQresultStatus(res)) == db_error_code_ok){	// values go to an arena in the same allocation
+		bool borrow = db->results_mode == db_results_borrowed;
+
+		db_results_t *results = db_results_new_arena(db_results_size_postgres(res, borrow));
+		db_results_set_message_lazy(results, "Query executed successfully", db->vendor);
+		db_process_entries_postgres(results, res, borrow);
+
+		if(borrow)
+			results->borrowed = res;
+		else
+			PQclear(res);
+
+		return results;
+	}
+
 	db_results_t *results = db_results_new(0, 0, db_error_code_ok, NULL);
 
 	// handle special error cases that the error map cant handle
 	if(res == NULL){
-		db_results_set_message(results, "Query response was null", db->vendor, PQresultErrorMessage(res));
+		results->code = db_error_code_fatal;
+		db_results_set_message(results, "Query response was null", db->vendor, PQerrorMessage(conn));
+		return results;
+	}
+
+	results->code = db_error_code_map(db->vendor, PQresultStatus(res));
+
+	if(results->code == db_error_code_fatal){										// remap from the sqlstate, locale independent
+		const db_sqlstate_postgres_t *state = db_sqlstate_map_postgres(PQresultErrorField(res, PG_DIAG_SQLSTATE));
+
+		if(state != NULL){
+			results->code = state->code;
+			db_results_set_message_lazy(results, state->msg, db->vendor);
+		}
+		else{
+			db_results_set_message_lazy(results, "Fatal error", db->vendor);
+		}
 	}
 	else{
-		db_error_code_t code = db_error_code_map(db->vendor, PQresultStatus(res));
-		char *msg = PQresultErrorMessage(res);
+		db_results_set_message_lazy(results, "Unexpected query status", db->vendor);
+	}
 
-		if(code == db_error_code_fatal){											// remap code to invalid type
-			if(strstr(msg, "invalid input syntax") != NULL){
-				results->code = db_error_code_invalid_type;
-				db_results_set_message(results, "Query has invalid param syntax", db->vendor, msg);
+	results->borrowed = res;														// message is formatted from it only if read
+	return results;
+}
+
+// result format for a query, binary only when every column of a described statement can be decoded
+static int db_result_format_postgres(db_t *db, db_statement_t *statement){
+	if(db->format != db_format_binary || statement == NULL || statement->context == NULL) return 0;
+	return ((db_statement_postgres_t*)statement->context)->binary_results ? 1 : 0;
+}
+
+// param types the server expects for a statement. NULL if unknown
+static Oid *db_param_targets_postgres(db_statement_t *statement, size_t params_count){
+	if(statement == NULL || statement->context == NULL) return NULL;
+
+	db_statement_postgres_t *described = statement->context;
+	if((size_t)described->params_count != params_count) return NULL;
+	return described->param_types;
+}
+
+static db_results_t *db_exec_function_postgres(db_t *db, void *connection, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, size_t timeout){
+	PGresult *res;
+	db_conn_postgres_t *pgconn = (db_conn_postgres_t*)connection;
+	PGconn *conn = pgconn->conn;
+
+	fio_lock(&pgconn->lock);
+
+	if(timeout > 0)																	// the pool maintenance cancels it once passed
+		__atomic_store_n(&pgconn->deadline, db_now_postgres() + timeout, __ATOMIC_SEQ_CST);
+
+	if(statement != NULL && !db_prepare_conn_postgres(db, pgconn)){				// prepared statement missing on this connection
+		res = NULL;
+	}
+	else if(statement == NULL && params_count == 0){								// no params
+		res = PQexec(conn, query);
+	}
+	else{																			// with params
+		db_params_postgres_t *encoded = db_params_new_postgres(params_count, params, db->format, db_param_targets_postgres(statement, params_count));
+
+		if(encoded == NULL){
+			__atomic_store_n(&pgconn->deadline, 0, __ATOMIC_SEQ_CST);
+			fio_unlock(&pgconn->lock);
+			return db_results_new(0, 0, db_error_code_invalid_type, "An input param for the query was invalid");
+		}
+
+		if(statement != NULL)
+			res = PQexecPrepared(conn, statement->name, encoded->count, (const char *const *)encoded->values, encoded->lengths, encoded->formats, db_result_format_postgres(db, statement));
+		else
+			res = PQexecParams(conn, query, encoded->count, encoded->types, (const char *const *)encoded->values, encoded->lengths, encoded->formats, 0);
+
+		free(encoded);
+	}
+
+	__atomic_store_n(&pgconn->deadline, 0, __ATOMIC_SEQ_CST);
+	fio_unlock(&pgconn->lock);
+	
+	return db_results_from_postgres(db, res, conn);
+}
+
+// pool queues for metrics, read without the lock
+static void db_pool_stats_postgres(db_t *db, size_t *queued, size_t *waiting){
+	db_pool_postgres_t *pool = db->context.pool;
+	if(pool == NULL) return;
+
+	*queued = __atomic_load_n(&pool->queued, __ATOMIC_RELAXED);
+	*waiting = __atomic_load_n(&pool->waiting, __ATOMIC_RELAXED);
+}
+
+// ------------------------------------------------------------ Postgres stream -----------------------------------------------------
+
+// exec query in single row mode, every row is handed to on_row as soon as it is read and freed after. Stopping cancels the query on the server
+static db_results_t *db_exec_stream_function_postgres(db_t *db, void *connection, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, db_row_callback_t on_row, void *udata){
+	db_conn_postgres_t *pgconn = (db_conn_postgres_t*)connection;
+	PGconn *conn = pgconn->conn;
+
+	db_params_postgres_t *encoded = db_params_new_postgres(params_count, params, db->format, db_param_targets_postgres(statement, params_count));
+	if(encoded == NULL)
+		return db_results_new(0, 0, db_error_code_invalid_type, "An input param for the query was invalid");
+
+	fio_lock(&pgconn->lock);
+
+	int sent;
+	if(statement != NULL && !db_prepare_conn_postgres(db, pgconn))					// prepared statement missing on this connection
+		sent = 0;
+	else if(statement != NULL)
+		sent = PQsendQueryPrepared(conn, statement->name, encoded->count, (const char *const *)encoded->values, encoded->lengths, encoded->formats, db_result_format_postgres(db, statement));
+	else
+		sent = PQsendQueryParams(conn, query, encoded->count, encoded->types, (const char *const *)encoded->values, encoded->lengths, encoded->formats, 0);
+
+	free(encoded);
+
+	if(!sent){
+		db_results_t *results = db_results_new_fmt(0, 0, db_error_code_connection_error, "Could not send query. (%s): %s", db_vendor_name_map(db->vendor), PQerrorMessage(conn));
+		fio_unlock(&pgconn->lock);
+		return results;
+	}
+
+	PQsetSingleRowMode(conn);
+
+	db_results_t *results = NULL;
+	bool stopped = false;
+	size_t rows = 0;
+	PGresult *res;
+
+	while((res = PQgetResult(conn)) != NULL){
+		if(stopped){																// cancelled, drain whatever is left
+			PQclear(res);
+			continue;
+		}
+
+		if(PQresultStatus(res) == PGRES_SINGLE_TUPLE){
+			db_results_t *row = db_results_from_postgres(db, res, conn);
+			bool more = on_row(row, udata);
+			db_results_destroy(row);
+			rows++;
+
+			if(!more){
+				stopped = true;
+
+				char error[256];
+				PGcancel *cancel = PQgetCancel(conn);
+				if(cancel != NULL){
+					PQcancel(cancel, error, sizeof(error));
+					PQfreeCancel(cancel);
+				}
 			}
-			else if(strstr(msg, "violates unique constraint") != NULL){				// remap unique
-	   			results->code = db_error_code_unique_constrain_violation;
-				db_results_set_message(results, "Entry already in database", db->vendor, msg);
+
+			continue;
+		}
+
+		if(results == NULL)															// the end of the rows or an error
+			results = db_results_from_postgres(db, res, conn);
+		else
+			PQclear(res);
+	}
+
+	fio_unlock(&pgconn->lock);
+
+	if(stopped){
+		db_results_destroy(results);
+		results = db_results_new(0, 0, db_error_code_ok, NULL);
+	}
+	else if(results == NULL){
+		results = db_results_new(0, 0, db_error_code_fatal, "Query returned no result");
+	}
+
+	if(results->code == db_error_code_ok){
+		char streamed[40];
+		snprintf(streamed, sizeof(streamed), "[%lu] rows", rows);
+		db_results_set_message(results, stopped ? "Query stopped by the row callback" : "Query streamed successfully", db->vendor, streamed);
+	}
+
+	return results;
+}
+
+// ------------------------------------------------------------ Postgres copy -------------------------------------------------------
+
+// parse uuid text into 16 bytes. false if malformed
+static bool db_uuid_parse_postgres(const char *text, int length, char *out){
+	int nibbles = 0;
+
+	for(int i = 0; i < length; i++){
+		char c = text[i];
+		int value;
+
+		if(c == '-' || c == '{' || c == '}')
+			continue;
+		else if(c >= '0' && c <= '9')
+			value = c - '0';
+		else if(c >= 'a' && c <= 'f')
+			value = c - 'a' + 10;
+		else if(c >= 'A' && c <= 'F')
+			value = c - 'A' + 10;
+		else
+			return false;
+
+		if(nibbles >= 32)
+			return false;
+
+		if(nibbles % 2 == 0)
+			out[nibbles / 2] = (char)(value << 4);
+		else
+			out[nibbles / 2] |= (char)value;
+
+		nibbles++;
+	}
+
+	return nibbles == 32;
+}
+
+// append one encoded row to the copy buffer in binary copy format. false if a value can't go binary for its column
+static bool db_copy_row_postgres(string *buffer, db_params_postgres_t *encoded, Oid *oids){
+	char field[4];
+
+	db_put_be32_postgres(field, (uint32_t)encoded->count);
+	string_cat_bytes(buffer, field + 2, 2);											// int16 fields count
+
+	for(int i = 0; i < encoded->count; i++){
+		char *value = encoded->values[i];
+		int length = encoded->lengths[i];
+
+		if(value == NULL){															// null
+			db_put_be32_postgres(field, (uint32_t)-1);
+			string_cat_bytes(buffer, field, 4);
+			continue;
+		}
+
+		if(encoded->formats[i] == 0){												// strings are encoded as text
+			length = strlen(value);
+
+			if(oids[i] == oid_uuid){
+				char uuid[16];
+				if(!db_uuid_parse_postgres(value, length, uuid))
+					return false;
+
+				db_put_be32_postgres(field, 16);
+				string_cat_bytes(buffer, field, 4);
+				string_cat_bytes(buffer, uuid, 16);
+				continue;
 			}
-			else if(strstr(msg, "too long") != NULL){								// remap unique
-	   			results->code = db_error_code_invalid_range;
-				db_results_set_message(results, "Invalid range for field", db->vendor, msg);
+
+			if(oids[i] != oid_text && oids[i] != oid_varchar && oids[i] != oid_bpchar && oids[i] != oid_name && oids[i] != oid_json)
+				return false;
+		}
+
+		db_put_be32_postgres(field, (uint32_t)length);
+		string_cat_bytes(buffer, field, 4);
+		string_cat_bytes(buffer, value, length);
+	}
+
+	return true;
+}
+
+// stream rows into table with binary copy. Rows are pulled from next_row until it returns false
+static db_results_t *db_copy_in_function_postgres(db_t *db, void *connection, char *table, char **fields, size_t fields_count, db_copy_row_t next_row, void *udata){
+	db_conn_postgres_t *pgconn = (db_conn_postgres_t*)connection;
+	PGconn *conn = pgconn->conn;
+
+	string *columns = string_new();
+	for(size_t i = 0; i < fields_count; i++){
+		if(i != 0)
+			string_cat_raw(columns, ",");
+
+		string_cat_raw(columns, fields[i]);
+	}
+
+	string *describe = string_sprint("select %s from %s limit 0", 40 + columns->len + strlen(table), columns->raw, table);
+	string *copy = string_sprint("copy %s (%s) from stdin (format binary)", 40 + columns->len + strlen(table), table, columns->raw);
+	string_destroy(columns);
+
+	fio_lock(&pgconn->lock);
+
+	// column types, binary copy needs the exact ones
+	PGresult *res = PQexec(conn, describe->raw);
+	string_destroy(describe);
+
+	if(PQresultStatus(res) != PGRES_TUPLES_OK){
+		fio_unlock(&pgconn->lock);
+		string_destroy(copy);
+		return db_results_from_postgres(db, res, conn);
+	}
+
+	Oid oids[fields_count + 1];
+	for(size_t i = 0; i < fields_count; i++)
+		oids[i] = PQftype(res, i);
+
+	PQclear(res);
+
+	res = PQexec(conn, copy->raw);
+	string_destroy(copy);
+
+	if(PQresultStatus(res) != PGRES_COPY_IN){
+		fio_unlock(&pgconn->lock);
+		return db_results_from_postgres(db, res, conn);
+	}
+
+	PQclear(res);
+
+	// header, signature then flags and extension length
+	string *buffer = string_new_sized(DB_COPY_BUFFER);
+	string_cat_bytes(buffer, "PGCOPY\n\377\r\n\0", 11);
+	string_cat_bytes(buffer, "\0\0\0\0\0\0\0\0", 8);
+
+	db_param_t row[fields_count + 1];
+	char *error = NULL;
+	size_t rows = 0;
+
+	while(error == NULL && next_row(row, udata)){
+		db_params_postgres_t *encoded = db_params_new_postgres(fields_count, row, db_format_binary, oids);
+
+		if(encoded == NULL || !db_copy_row_postgres(buffer, encoded, oids))
+			error = "An input param for the copy was invalid";
+		else
+			rows++;
+
+		free(encoded);
+
+		if(error == NULL && buffer->len >= DB_COPY_BUFFER){							// flush full buffer
+			if(PQputCopyData(conn, buffer->raw, buffer->len) != 1)
+				error = PQerrorMessage(conn);
+
+			buffer->len = 0;
+		}
+	}
+
+	if(error == NULL){
+		string_cat_bytes(buffer, "\377\377", 2);									// trailer
+		if(PQputCopyData(conn, buffer->raw, buffer->len) != 1)
+			error = PQerrorMessage(conn);
+	}
+
+	string_destroy(buffer);
+
+	db_results_t *results = NULL;
+
+	if(PQputCopyEnd(conn, error) != 1){
+		results = db_results_new_fmt(0, 0, db_error_code_connection_error, "Could not end copy. (%s): %s", db_vendor_name_map(db->vendor), PQerrorMessage(conn));
+	}
+
+	while((res = PQgetResult(conn)) != NULL){										// copy outcome, then the end of it
+		if(results == NULL)
+			results = db_results_from_postgres(db, res, conn);
+		else
+			PQclear(res);
+	}
+
+	fio_unlock(&pgconn->lock);
+
+	if(results == NULL)
+		results = db_results_new(0, 0, db_error_code_fatal, "Copy returned no result");
+
+	if(results->code == db_error_code_ok){
+		char copied[40];
+		snprintf(copied, sizeof(copied), "[%lu] rows", rows);
+		db_results_set_message(results, "Copy executed successfully", db->vendor, copied);
+	}
+
+	return results;
+}
+
+// ------------------------------------------------------------ Postgres async ------------------------------------------------------
+
+static void db_async_run_postgres(db_t *db, db_conn_postgres_t *pgconn, db_queue_postgres_t *batch);
+
+// deliver results of finished requests
+static void db_async_deliver_postgres(db_queue_postgres_t *finished){
+	db_request_postgres_t *request;
+
+	while((request = db_queue_pop_postgres(finished)) != NULL){
+		db_results_t *results = request->results;
+		if(results == NULL)
+			results = db_results_new(0, 0, db_error_code_fatal, "Query returned no result");
+
+		if(request->abandoned){													// the caller already got its timeout
+			db_results_destroy(results);
+			db_request_destroy_postgres(request);
+			continue;
+		}
+
+		db_metrics_end(request->metric, request->started, results->code);
+		request->callback(results, request->udata);
+		db_request_destroy_postgres(request);
+	}
+}
+
+// socket readable, consume whatever arrived and hand results back to each request in order
+static void db_async_on_data_postgres(intptr_t uuid, fio_protocol_s *protocol){
+	db_conn_postgres_t *pgconn = (db_conn_postgres_t*)((char*)protocol - offsetof(db_conn_postgres_t, protocol));
+	db_t *db = pgconn->db;
+	db_queue_postgres_t finished = {0};
+	db_queue_postgres_t batch = {0};
+
+	if(fio_trylock(&pgconn->lock))													// someone else is talking to the server, it will read the data
+		return;
+
+	if(pgconn->inflight.first == NULL){												// idle, just drain notices
+		PQconsumeInput(pgconn->conn);
+		fio_unlock(&pgconn->lock);
+		return;
+	}
+
+	if(!PQconsumeInput(pgconn->conn)){												// connection broke, fail the whole batch
+		db_request_postgres_t *request;
+		while((request = db_queue_pop_postgres(&pgconn->inflight)) != NULL){
+			if(request->results == NULL)
+				request->results = db_results_new_fmt(0, 0, db_error_code_connection_error, "Connection lost while waiting for query. (%s): %s", db_vendor_name_map(db->vendor), PQerrorMessage(pgconn->conn));
+
+			db_queue_push_postgres(&finished, request);
+		}
+	}
+	else{
+		while(pgconn->inflight.first != NULL && !PQisBusy(pgconn->conn)){
+			db_request_postgres_t *request = pgconn->inflight.first;
+			PGresult *res = PQgetResult(pgconn->conn);
+
+			if(res == NULL){														// end of this query results, its sync comes next
+				if(request->results_done)
+					break;
+
+				request->results_done = true;
+				continue;
 			}
-			else if(strstr(msg, "too short") != NULL){								// remap unique
-	   			results->code = db_error_code_invalid_range;
-				db_results_set_message(results, "Invalid range for field", db->vendor, msg);
+
+			switch(PQresultStatus(res)){
+				case PGRES_PIPELINE_SYNC:											// request done
+					db_queue_push_postgres(&finished, db_queue_pop_postgres(&pgconn->inflight));
+					break;
+
+				case PGRES_PIPELINE_ABORTED:
+					if(request->results == NULL)
+						request->results = db_results_new_fmt(0, 0, db_error_code_fatal, "Query aborted by an earlier error in the pipeline. (%s): %s", db_vendor_name_map(db->vendor), PQresultErrorMessage(res));
+					break;
+
+				default:
+					if(request->results == NULL){									// only the first result of a query is kept
+						request->results = db_results_from_postgres(db, res, pgconn->conn);
+						res = NULL;													// taken by the results
+					}
+					break;
 			}
-			else{
-				db_results_set_message(results, "Fatal error", db->vendor, msg);
+
+			PQclear(res);
+		}
+	}
+
+	bool idle = pgconn->inflight.first == NULL;
+	if(idle)
+		PQexitPipelineMode(pgconn->conn);
+
+	__atomic_store_n(&pgconn->deadline, idle ? 0 : pgconn->inflight.first->deadline, __ATOMIC_SEQ_CST);	// the next query in the pipeline gets its own time
+
+	fio_unlock(&pgconn->lock);
+
+	if(idle){
+		db_pool_release_postgres(db, pgconn, &batch);
+
+		if(batch.first != NULL)
+			db_async_run_postgres(db, pgconn, &batch);
+	}
+
+	db_async_deliver_postgres(&finished);
+
+	(void)uuid;
+}
+
+// reactor closed the socket (shutdown or reset), attach again on next use
+static void db_async_on_close_postgres(intptr_t uuid, fio_protocol_s *protocol){
+	db_conn_postgres_t *pgconn = (db_conn_postgres_t*)((char*)protocol - offsetof(db_conn_postgres_t, protocol));
+	if(pgconn->uuid == uuid)														// a reset may have attached a new socket already
+		pgconn->uuid = -1;
+}
+
+// connections are long lived, never time them out
+static void db_async_ping_postgres(intptr_t uuid, fio_protocol_s *protocol){
+	fio_touch(uuid);
+	(void)protocol;
+}
+
+// attach the connection socket to the reactor. A dup is attached so the reactor closing it never closes libpq's socket
+static bool db_async_attach_postgres(db_conn_postgres_t *pgconn){
+	if(pgconn->uuid != -1) return true;
+
+	int fd = dup(PQsocket(pgconn->conn));											// libpq sockets are always non blocking
+	if(fd == -1) return false;
+
+	pgconn->protocol = (fio_protocol_s){
+		.on_data = db_async_on_data_postgres,
+		.on_close = db_async_on_close_postgres,
+		.ping = db_async_ping_postgres
+	};
+
+	pgconn->uuid = fio_fd2uuid(fd);
+	if(pgconn->uuid == -1){
+		close(fd);
+		return false;
+	}
+
+	fio_attach(pgconn->uuid, &pgconn->protocol);									// on failure on_close resets the uuid
+
+	return pgconn->uuid != -1;
+}
+
+// send a batch of requests through the pipeline of a connection owned by the caller. Each query gets its own sync so an error only fails its own request
+static void db_async_run_postgres(db_t *db, db_conn_postgres_t *pgconn, db_queue_postgres_t *batch){
+	db_queue_postgres_t finished = {0};
+
+	while(batch->first != NULL){
+		fio_lock(&pgconn->lock);
+
+		bool ok = db_async_attach_postgres(pgconn) && db_prepare_conn_postgres(db, pgconn) && PQenterPipelineMode(pgconn->conn);
+		char *error = ok ? NULL : "Could not start pipeline on connection";
+
+		db_request_postgres_t *request;
+		while((request = db_queue_pop_postgres(batch)) != NULL){
+			db_params_postgres_t *encoded = request->params;
+			db_metrics_wait(request->started);
+
+			if(
+				ok &&
+				(request->statement != NULL ?
+					PQsendQueryPrepared(pgconn->conn, request->statement->name, encoded->count, (const char *const *)encoded->values, encoded->lengths, encoded->formats, request->result_format) :
+					PQsendQueryParams(pgconn->conn, request->query, encoded->count, encoded->types, (const char *const *)encoded->values, encoded->lengths, encoded->formats, request->result_format)
+				) &&
+				#ifdef LIBPQ_HAS_SEND_PIPELINE_SYNC
+				PQsendPipelineSync(pgconn->conn)
+				#else
+				PQpipelineSync(pgconn->conn)
+				#endif
+			){
+				db_queue_push_postgres(&pgconn->inflight, request);
+				continue;
 			}
+
+			ok = false;																// once a send fails the connection is unusable for this batch
+			if(error == NULL)
+				error = PQerrorMessage(pgconn->conn);
+
+			request->results = db_results_new_fmt(0, 0, db_error_code_connection_error, "Could not send query. (%s): %s", db_vendor_name_map(db->vendor), error);
+			db_queue_push_postgres(&finished, request);
 		}
-		else if(code == db_error_code_ok){								// complement ok message
-			db_results_set_message(results, "Query executed successfully", db->vendor, msg);
+
+		#ifdef LIBPQ_HAS_SEND_PIPELINE_SYNC
+		if(ok)
+			PQflush(pgconn->conn);
+		#endif
+
+		if(pgconn->inflight.first != NULL){											// batch is on the wire, on_data takes it from here
+			__atomic_store_n(&pgconn->deadline, pgconn->inflight.first->deadline, __ATOMIC_SEQ_CST);
+			fio_unlock(&pgconn->lock);
+			fio_force_event(pgconn->uuid, FIO_EVENT_ON_DATA);						// data that arrived while locked would be missed otherwise
+			break;
 		}
+
+		PQexitPipelineMode(pgconn->conn);
+		fio_unlock(&pgconn->lock);
+		db_pool_release_postgres(db, pgconn, batch);
 	}
 
-	if(results->code == db_error_code_ok){
-		db_process_entries_postgres(results, res);
+	db_async_deliver_postgres(&finished);
+}
+
+// exec query without blocking, callback is called from the reactor
+static void db_exec_async_function_postgres(db_t *db, db_callback_t callback, void *udata, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, size_t timeout){
+	uint64_t started = db_metrics_start();
+	db_params_postgres_t *encoded = db_params_new_postgres(params_count, params, db->format, db_param_targets_postgres(statement, params_count));
+
+	if(encoded == NULL){
+		db_metrics_end(db_metrics_slot(db, statement), started, db_error_code_invalid_type);
+		callback(db_results_new(0, 0, db_error_code_invalid_type, "An input param for the query was invalid"), udata);
+		return;
 	}
-	
-    PQclear(res);
-	return results;
-}
\ No newline at end of file
+
+	db_request_postgres_t *request = calloc(1, sizeof(db_request_postgres_t));
+	request->query = query != NULL ? strdup(query) : NULL;
+	request->statement = statement;
+	request->params = encoded;
+	request->result_format = db_result_format_postgres(db, statement);
+	request->callback = callback;
+	request->udata = udata;
+	request->metric = db_metrics_slot(db, statement);
+	request->started = started;
+	request->deadline = timeout > 0 ? db_now_postgres() + timeout : 0;
+
+	if(db->state != db_state_connected){
+		db_metrics_end(request->metric, started, db_error_code_connection_error);
+		callback(db_results_new(0, 0, db_error_code_connection_error, "Database not connected"), udata);
+		db_request_destroy_postgres(request);
+		return;
+	}
+
+	if(timeout > 0)
+		db_pool_deadline_arm_postgres(db->context.pool, timeout);
+
+	db_queue_postgres_t batch = {0};
+	db_conn_postgres_t *pgconn = db_pool_claim_postgres(db);
+
+	if(pgconn != NULL){
+		db_queue_push_postgres(&batch, request);
+	}
+	else{																			// every connection busy, goes out with the next batch
+		db_pool_postgres_t *pool = db->context.pool;
+
+		pthread_mutex_lock(&(db->context.connections_lock));
+		db_queue_push_postgres(&pool->pending, request);
+		fio_atomic_add(&pool->queued, 1);
+		pthread_mutex_unlock(&(db->context.connections_lock));
+
+		pgconn = db_pool_claim_postgres(db);										// freed meanwhile, its owner may have missed the request
+		if(pgconn == NULL) return;
+
+		db_pool_release_postgres(db, pgconn, &batch);
+	}
+
+	if(batch.first != NULL)
+		db_async_run_postgres(db, pgconn, &batch);
+}
+
+// read the results of async queries already sent until none is left, polling the sockets as the reactor would. Only once the reactor stopped, nothing else may read these connections
+static bool db_settle_function_postgres(db_t *db, size_t timeout){
+	db_conn_postgres_t **connections = db->context.connections;
+	if(connections == NULL)
+		return true;
+
+	size_t count = db->context.connections_count;
+	struct pollfd fds[count];
+	db_conn_postgres_t *polled[count];
+	uint64_t deadline = db_metrics_now() / 1000 + timeout;
+
+	while(true){
+		size_t n = 0;
+
+		for(size_t i = 0; i < count; i++){
+			db_conn_postgres_t *pgconn = connections[i];
+
+			if(pgconn->inflight.first != NULL){
+				fds[n] = (struct pollfd){ .fd = PQsocket(pgconn->conn), .events = POLLIN, .revents = 0 };
+				polled[n++] = pgconn;
+			}
+		}
+
+		if(n == 0)																	// released connections already took what was queued
+			return true;
+
+		uint64_t now = db_metrics_now() / 1000;
+		if(now >= deadline)
+			return false;
+
+		poll(fds, n, (int)(deadline - now));
+
+		for(size_t k = 0; k < n; k++){
+			if(fds[k].revents != 0)
+				db_async_on_data_postgres(polled[k]->uuid, &polled[k]->protocol);
+		}
+	}
+}
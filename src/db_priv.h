@@ -4,6 +4,19 @@
 #include "db.h"
 #include <stdarg.h>
 
+// ------------------------------------------------------------ Arena --------------------------------------------------------------
+
+#define DB_ARENA_CHUNK 4096
+
+// bump allocator chunk, the first one is embedded after the results
+typedef struct db_arena_t{
+	struct db_arena_t *next;
+	size_t size;
+	size_t used;
+	bool embedded;
+	_Alignas(8) char data[];														// every value decoded needs at most 8 bytes alignment
+}db_arena_t;
+
 // ------------------------------------------------------------ Maps ---------------------------------------------------------------
 
 // vendor name map
@@ -18,7 +31,28 @@ db_error_code_t db_connect_function_map(db_t *db);
 void db_destroy_function_map(db_t *db);
 
 // exec query map
-static db_results_t *db_exec_function_map(db_t *db, void *connection, char *query, size_t params_count, va_list params);
+static db_results_t *db_exec_function_map(db_t *db, void *connection, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, size_t timeout);
+
+// exec async query map
+static void db_exec_async_function_map(db_t *db, db_callback_t callback, void *udata, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, size_t timeout);
+
+// copy in map
+static db_results_t *db_copy_in_function_map(db_t *db, void *connection, char *table, char **fields, size_t fields_count, db_copy_row_t next_row, void *udata);
+
+// streamed query map
+static db_results_t *db_exec_stream_function_map(db_t *db, void *connection, db_statement_t *statement, char *query, size_t params_count, db_param_t *params, db_row_callback_t on_row, void *udata);
+
+// decode a borrowed entry on first read
+static void db_entry_decode_function_map(db_results_t *results, db_entry_t *entry, uint32_t row, uint32_t field);
+
+// vendor message kept in the vendor result. NULL if none
+static const char *db_results_vendor_message_function_map(db_results_t *results);
+
+// release the vendor result of borrowed results
+static void db_results_release_function_map(db_results_t *results);
+
+// pool queues for metrics, async requests waiting for a connection and blocked callers
+static void db_pool_stats_function_map(db_t *db, size_t *queued, size_t *waiting);
 
 // ------------------------------------------------------------ Error handlng ------------------------------------------------------
 
@@ -28,7 +62,52 @@ db_results_t *db_results_new(int64_t entries, int64_t fields, db_error_code_t co
 // create new result object
 db_results_t *db_results_new_fmt(int64_t entries, int64_t fields, db_error_code_t code, char *fmt, ...);
 
-// set result msg
+// create new result object with an arena of size bytes in the same allocation
+db_results_t *db_results_new_arena(size_t size);
+
+// allocate from the results arena, grows with extra chunks when full. Freed by db_results_destroy()
+void *db_results_alloc(db_results_t *results, size_t size, size_t align);
+
+// set result msg, formatted now as vendor_msg may not outlive the call
 void db_results_set_message(db_results_t *results, char *msg, db_vendor_t vendor, char *vendor_msg);
 
+// set result msg, formatted on first read with the vendor message kept in results->borrowed. msg must be static
+void db_results_set_message_lazy(db_results_t *results, const char *msg, db_vendor_t vendor);
+
+// ------------------------------------------------------------ Results ------------------------------------------------------------
+
+// get single entry, decoding it first when borrowed. NULL if non existent | invalid
+db_entry_t *db_results_get_entry(db_results_t *results, uint32_t entry, uint32_t field);
+
+// ------------------------------------------------------------ Metrics ------------------------------------------------------------
+
+#define DB_METRICS_STATEMENTS 32													// prepared statements with their own histogram, slot 0 takes plain queries and any statement past it
+#define DB_METRICS_SUB_BITS 2														// histogram buckets per power of two as bits, 4 keep the error under 25%
+#define DB_METRICS_BUCKETS 104														// up to 2^27us, about 134s. Slower lands in the last one
+
+// counters of a single thread, only it writes them. Readers sum every shard
+typedef struct db_metrics_shard_t{
+	struct db_metrics_shard_t *next;
+	uint64_t latency[DB_METRICS_STATEMENTS][DB_METRICS_BUCKETS];
+	uint64_t latency_sum[DB_METRICS_STATEMENTS];									// us
+	uint64_t wait[DB_METRICS_BUCKETS];
+	uint64_t wait_sum;																// us
+	uint64_t errors[db_error_code_max];
+}db_metrics_shard_t;
+
+// monotonic clock in us
+uint64_t db_metrics_now();
+
+// query started, counts it in flight. Returns the start time for db_metrics_wait() and db_metrics_end()
+uint64_t db_metrics_start();
+
+// histogram slot of a statement, NULL for plain queries
+size_t db_metrics_slot(db_t *db, db_statement_t *statement);
+
+// query got its connection
+void db_metrics_wait(uint64_t started);
+
+// query finished with code, records its latency since started
+void db_metrics_end(size_t slot, uint64_t started, db_error_code_t code);
+
 #endif
\ No newline at end of file
@@ -122,6 +122,19 @@ void string_cat_raw(string *dest, char *src){
 	_string_cat_raw(dest, src, strlen(src));
 }
 
+void string_cat_bytes(string *dest, const void *src, size_t srclen){
+	if(dest == NULL || src == NULL) return;
+
+	if(dest->allocated < (dest->len + srclen + 1)){
+		dest->allocated = (dest->len + srclen + 1) * 2;
+		dest->raw = realloc(dest->raw, dest->allocated);
+	}
+
+	memcpy(dest->raw + dest->len, src, srclen);
+	dest->len += srclen;
+	dest->raw[dest->len] = '\0';
+}
+
 void string_cat(string *dest, string *src){
 	if(dest == NULL || src == NULL) return;
 
@@ -142,3 +155,40 @@ void string_cat_fmt(string *str, const char *fmt, size_t buffer_size, ...){
 	string_cat_vfmt(str, fmt, buffer_size, args);
 	va_end(args);
 }
+
+void string_cat_json(string *json, const char *value){
+	static const char hex[] = "0123456789abcdef";
+
+	if(json == NULL || value == NULL) return;
+
+	string_cat_bytes(json, "\"", 1);
+
+	const unsigned char *run = (const unsigned char*)value;
+	const unsigned char *p = run;
+	for(; *p; p++){
+		if(*p >= 0x20 && *p != '"' && *p != '\\')
+			continue;
+
+		string_cat_bytes(json, run, p - run);
+		run = p + 1;
+
+		switch(*p){
+			case '"':  string_cat_bytes(json, "\\\"", 2); break;
+			case '\\': string_cat_bytes(json, "\\\\", 2); break;
+			case '\n': string_cat_bytes(json, "\\n", 2); break;
+			case '\r': string_cat_bytes(json, "\\r", 2); break;
+			case '\t': string_cat_bytes(json, "\\t", 2); break;
+			case '\b': string_cat_bytes(json, "\\b", 2); break;
+			case '\f': string_cat_bytes(json, "\\f", 2); break;
+			default:
+			{
+				char escaped[6] = {'\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 0xF]};
+				string_cat_bytes(json, escaped, 6);
+			}
+			break;
+		}
+	}
+
+	string_cat_bytes(json, run, p - run);
+	string_cat_bytes(json, "\"", 1);
+}
@@ -46,8 +46,12 @@ void string_cat_raw(string *dest, char *src);
 
 void string_cat(string *dest, string *src);
 
+void string_cat_bytes(string *dest, const void *src, size_t srclen);
+
 void string_cat_vfmt(string *string, const char *fmt, size_t buffer_size, va_list args);
 
 void string_cat_fmt(string *string, const char *fmt, size_t buffer_size, ...);
 
+void string_cat_json(string *json, const char *value);
+
 #endif